@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "flash_bd.hpp"
+#include "sim_flash.hpp"
+
+// Size of the flash region the checks run on.
+static constexpr uint32_t REGION = 256 * 1024;
+
+// Check that a FlashBD holds `expect` at `offset`, counting and reporting a mismatch.
+static uint32_t expectData(FlashBD &dev, const char *what, uint32_t offset, const uint8_t *expect, uint32_t length) {
+	std::vector<uint8_t> found(length);
+	if (dev.read(offset, found.data(), length) != FileError::OK || memcmp(found.data(), expect, length)) {
+		printf("Error: %s at %u doesn't read back\n", what, offset);
+		return 1;
+	}
+	return 0;
+}
+
+// Write a whole aligned run at an odd byte offset, and from a buffer that isn't word aligned, in every way FlashBD is written.
+// The region starts full of data, so the first pass erases, and the second only clears bits, so it programs over what is there.
+// This builds FlashBD with the alignment sanitizer, so reading the caller's buffer a word at a time is caught.
+// Returns the number of failed checks.
+static uint32_t check(const char *name, uint32_t journal) {
+	SimFlash sim(REGION + (journal ? (journal + 1) * 4096 : 0));
+	std::vector<uint8_t> image(REGION);
+	for (uint8_t &b: image) b = rand();
+	sim.load(0, image.data(), image.size());
+	
+	// Aligned runs of 32 KiB and more skip the write cache, so these cover two of them.
+	const uint32_t run    = 32768;
+	const uint32_t length = 2 * run + 512;
+	std::vector<uint8_t> buf(length + 1);
+	uint8_t *data   = buf.data() + 1;
+	uint32_t failed = 0;
+	
+	for (int pass = 0; pass < 2; pass++) {
+		FlashBD dev(sim, 512, 0, sim.size(), 16, journal);
+		if (pass) dev.read(run, data, length);
+		for (uint32_t i = 0; i < length; i++) data[i] = pass ? data[i] & rand() : rand();
+		
+		// Whole blocks from an odd address, as `writeRange` passes them on.
+		uint32_t erases = dev.ioStats().erases;
+		dev.writeBlocks(run / 512, length / 512, data);
+		failed += expectData(dev, "writeBlocks", run, data, length);
+		if (pass && dev.ioStats().erases != erases) {
+			printf("Error: clearing bits erased flash\n");
+			failed ++;
+		}
+		
+		// An odd byte offset, through the write cache and through `writeRange`.
+		dev.write(run - 1, data, length);
+		failed += expectData(dev, "write", run - 1, data, length);
+		dev.BlockDevice::write(run + 1, data, length);
+		failed += expectData(dev, "writeRange", run + 1, data, length);
+		
+		// All of it must be in flash after a sync.
+		dev.sync();
+		FlashBD again(sim, 512, 0, sim.size(), 16, journal);
+		failed += expectData(again, "synced write", run + 1, data, length);
+	}
+	
+	printf("%s: %s\n", name, failed ? "failed" : "ok");
+	return failed;
+}
+
+// Write to FlashBD from buffers that aren't word aligned and at odd byte offsets, and check what reads back.
+// Usage: aligncheck
+int main() {
+	srand(1);
+	uint32_t failed = check("FlashBD", 0) + check("FlashBD journaled", 4);
+	if (failed) {
+		printf("Error: %u checks failed\n", failed);
+		return 1;
+	}
+	return 0;
+}
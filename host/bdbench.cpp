@@ -0,0 +1,133 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "bd_bench.hpp"
+#include "cached_bd.hpp"
+#include "compressed_bd.hpp"
+#include "file_bd.hpp"
+#include "flash_bd.hpp"
+#include "ftl_bd.hpp"
+#include "overlay_bd.hpp"
+#include "rom_bd.hpp"
+#include "sim_flash.hpp"
+
+// Read a whole file into memory.
+static bool readFile(const char *path, std::vector<uint8_t> &out) {
+	FILE *fd = fopen(path, "rb");
+	if (!fd) return false;
+	uint8_t buf[4096];
+	size_t read;
+	while ((read = fread(buf, 1, sizeof(buf), fd)) > 0) {
+		out.insert(out.end(), buf, buf + read);
+	}
+	fclose(fd);
+	return true;
+}
+
+// Write a scratch copy of an image, so the write workloads don't destroy the original.
+static bool writeScratch(char *path, const std::vector<uint8_t> &data) {
+	int fd = mkstemp(path);
+	if (fd < 0) return false;
+	bool ok = write(fd, data.data(), data.size()) == (ssize_t) data.size();
+	close(fd);
+	return ok;
+}
+
+// Print how much a benchmark erased, programmed and kept the simulated flash busy.
+static void printFlash(const SimFlash &sim) {
+	printf("Flash: %llu sectors erased (at most %u times each), %llu pages programmed, %.1f ms busy\n",
+		(unsigned long long) sim.totalErases(), sim.maxEraseCount(),
+		(unsigned long long) sim.pagePrograms(), sim.busyMicros() / 1000.0);
+}
+
+// Run the block device benchmarks against an image.
+// The image may also be a compressed image made by `lz4pack.py`.
+// Usage: bdbench <image> [ops]
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		printf("Usage: %s <image> [ops]\n", argv[0]);
+		return 1;
+	}
+	BenchConfig cfg{256, false, 1};
+	if (argc > 2) cfg.ops = atoi(argv[2]);
+	
+	std::vector<uint8_t> image;
+	if (!readFile(argv[1], image)) {
+		printf("Error: can't read %s\n", argv[1]);
+		return 1;
+	}
+	
+	// Compressed images are benchmarked as-is, then unpacked for the rest.
+	if (image.size() >= 4 && !memcmp(image.data(), "BDZ1", 4)) {
+		CompressedBD compressed(image.data(), image.size(), 512);
+		bdBench(compressed, "CompressedBD", cfg);
+		std::vector<uint8_t> raw(compressed.blocks() * 512);
+		if (compressed.read(0, raw.data(), raw.size())) {
+			printf("Error: can't unpack %s\n", argv[1]);
+			return 1;
+		}
+		image = std::move(raw);
+	}
+	
+	// The embedded image, as on the device.
+	RomBD rom(image.data(), 512, image.size());
+	bdBench(rom, "RomBD", cfg);
+	
+	// Everything else gets to write to a scratch copy.
+	char path[] = "/tmp/bdbench-XXXXXX";
+	if (!writeScratch(path, image)) {
+		printf("Error: can't write scratch image\n");
+		return 1;
+	}
+	cfg.writes = true;
+	
+	{
+		FileBD file(path, 512, true, true);
+		bdBench(file, "FileBD (mmap)", cfg);
+	}
+	{
+		FileBD file(path, 512, true, false);
+		bdBench(file, "FileBD (pread)", cfg);
+	}
+	{
+		OverlayBD overlay(std::make_unique<RomBD>(image.data(), 512, image.size()), image.size() / 512);
+		bdBench(overlay, "OverlayBD (RomBD)", cfg);
+	}
+	{
+		CachedBD cached(std::make_unique<FileBD>(path, 512, true, false), 8192);
+		bdBench(cached, "CachedBD 8 KiB (FileBD pread)", cfg);
+		printf("Cache: %u hits, %u misses, %u evictions, %u writebacks\n",
+			cached.stats().hits, cached.stats().misses, cached.stats().evictions, cached.stats().writebacks);
+	}
+	
+	{
+		// The flash block devices, on simulated flash with the image in it.
+		SimFlash sim(image.size() + 4095);
+		sim.load(0, image.data(), image.size());
+		FlashBD flash(sim, 512, 0, sim.size());
+		bdBench(flash, "FlashBD (SimFlash)", cfg);
+		flash.sync();
+		printFlash(sim);
+	}
+	{
+		// The same with the journal, which takes 5 sectors off the end.
+		SimFlash sim(image.size() + 4095 + 5 * 4096);
+		sim.load(0, image.data(), image.size());
+		FlashBD flash(sim, 512, 0, sim.size(), 16, 4);
+		bdBench(flash, "FlashBD journaled (SimFlash)", cfg);
+		flash.sync();
+		printFlash(sim);
+	}
+	{
+		SimFlash sim(image.size() + 4095);
+		FtlBD ftl(sim, 0, sim.size());
+		bdBench(ftl, "FtlBD (SimFlash)", cfg);
+		printFlash(sim);
+	}
+	
+	unlink(path);
+	return 0;
+}
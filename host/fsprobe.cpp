@@ -0,0 +1,79 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include "devfs.hpp"
+#include "file_bd.hpp"
+#include "fatfs.hpp"
+
+// Mount a FAT image and list a directory or read a file from it.
+// Usage: fsprobe [-p] <image> [path]
+// With -p, the image is read with `pread` instead of being memory-mapped.
+int main(int argc, char **argv) {
+	bool usePread = argc > 1 && !strcmp(argv[1], "-p");
+	if (usePread) {
+		argc --;
+		argv ++;
+	}
+	if (argc < 2) {
+		printf("Usage: %s [-p] <image> [path]\n", argv[0]);
+		return 1;
+	}
+	Path path(argc > 2 ? argv[2] : "/");
+	
+	// Mount the image read-only.
+	auto media = std::make_unique<FileBD>(argv[1], 512, false, !usePread);
+	DevFS dev;
+	dev.addBlockDevice("image", media.get());
+	FatFS fat(std::move(media), false);
+	
+	// Try it as a directory first.
+	FileError ec{OK};
+	auto listing = fat.list(ec, path);
+	if (!ec) {
+		for (auto &ent: listing) {
+			if (ent.isDirectory)
+				printf("%-12s: directory\n", ent.name.c_str());
+			else
+				printf("%-12s: %zu bytes\n", ent.name.c_str(), ent.size);
+		}
+		off_t free = fat.freeClusters(ec);
+		if (!ec) printf("%u of %u clusters free\n", (unsigned) free, (unsigned) fat.clusterCount());
+		return 0;
+	}
+	
+	// Otherwise, read it as a file.
+	ec = FileError::OK;
+	auto fd = fat.open(ec, path, Open::RB);
+	if (!fd) {
+		printf("Error: %s\n", strerror((int) ec));
+		return 1;
+	}
+	
+	// Time reading the whole thing.
+	char buf[4096];
+	std::size_t total = 0;
+	auto start = std::chrono::steady_clock::now();
+	while (1) {
+		int read = fd->read(ec, buf, sizeof(buf));
+		if (ec) {
+			printf("Error: %s\n", strerror((int) ec));
+			return 1;
+		}
+		if (read <= 0) break;
+		total += read;
+	}
+	auto end = std::chrono::steady_clock::now();
+	
+	long us = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+	printf("Read %zu bytes in %ld us\n", total, us);
+	
+	// Show how much of that went to the block device.
+	auto stats = dev.open(ec, "/blkstat", Open::R);
+	while (stats) {
+		int read = stats->read(ec, buf, sizeof(buf));
+		if (read <= 0) break;
+		fwrite(buf, 1, read, stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "bd_clock.hpp"
+#include "flash_bd.hpp"
+#include "flash_lockout.hpp"
+#include "sim_flash.hpp"
+
+// Simulated flash whose writes go through a lockout, like `PicoFlash`.
+// Each write holds the flash for some real time, so the victim thread gets to run into it.
+class LockedFlash: public SimFlash {
+	public:
+		// Keeps the victim off flash while erasing or programming.
+		FlashLockout lockout;
+		// Set while the flash is being written, when the victim must not touch it.
+		std::atomic<bool> writing{false};
+		// Whether the lockout is used at all, to check that the model catches its absence.
+		bool enabled;
+		// Real time each write holds the flash, in microseconds.
+		uint32_t holdMicros;
+		// Number of erases and programs done.
+		uint32_t writes = 0;
+		
+		LockedFlash(uint32_t size, bool _enabled, uint32_t _holdMicros):
+			SimFlash(size), enabled(_enabled), holdMicros(_holdMicros) {}
+		
+		// Hold the flash as busy for `holdMicros` of real time.
+		void hold() {
+			if (enabled) lockout.begin();
+			writes ++;
+			writing = true;
+			uint64_t until = bdNanos() + holdMicros * 1000;
+			while (bdNanos() < until);
+			writing = false;
+			if (enabled) lockout.end();
+		}
+		
+		void erase(uint32_t offset, uint32_t length) {
+			hold();
+			SimFlash::erase(offset, length);
+		}
+		void program(uint32_t offset, const uint8_t *in, uint32_t length) {
+			hold();
+			SimFlash::program(offset, in, length);
+		}
+};
+
+// What the victim thread got done.
+struct VictimResult {
+	// Steps run from flash.
+	uint64_t flashSteps;
+	// Steps run from RAM.
+	uint64_t ramSteps;
+	// Steps run from flash while it was being written, which would crash the device.
+	uint64_t faults;
+};
+
+// The other core: alternates between code from flash, which checkpoints every `checkEvery` steps, and code from RAM.
+static void victim(LockedFlash &flash, std::atomic<bool> &stop, uint32_t checkEvery, VictimResult &out) {
+	flash.lockout.victimInit();
+	while (!stop) {
+		// Every step from flash fetches from it.
+		for (uint32_t i = 1; i <= 1000; i++) {
+			if (flash.writing) out.faults ++;
+			out.flashSteps ++;
+			if (i % checkEvery == 0) flash.lockout.checkpoint();
+		}
+		
+		// Flash may be written while in RAM.
+		flash.lockout.enterRam();
+		for (uint32_t i = 0; i < 1000; i++) {
+			out.ramSteps ++;
+		}
+		flash.lockout.leaveRam();
+	}
+	flash.lockout.victimExit();
+}
+
+// Write random blocks to a FlashBD on one thread, while a victim thread runs on the other.
+// Returns the number of faults.
+static uint64_t run(const char *name, bool enabled, uint32_t ops, uint32_t checkEvery) {
+	LockedFlash flash(256 * 1024, enabled, 20);
+	FlashBD dev(flash, 512, 0, flash.size());
+	std::atomic<bool> stop{false};
+	VictimResult result{};
+	std::thread thread(victim, std::ref(flash), std::ref(stop), checkEvery, std::ref(result));
+	
+	uint8_t block[512];
+	srand(1);
+	for (uint32_t i = 0; i < ops; i++) {
+		for (uint8_t &b: block) b = rand();
+		dev.writeBlocks(rand() % dev.blocks(), 1, block);
+		if (i % 50 == 49) dev.sync();
+	}
+	dev.sync();
+	stop = true;
+	thread.join();
+	
+	const FlashLockout::Stats &s = flash.lockout.stats();
+	printf("%s: %u flash writes, victim ran %llu steps from flash and %llu from RAM, %llu faults\n",
+		name, flash.writes, (unsigned long long) result.flashSteps, (unsigned long long) result.ramSteps,
+		(unsigned long long) result.faults);
+	if (enabled) {
+		printf("  parked %u times; wait avg %.1f us, max %u us; locked avg %.1f us, max %u us\n",
+			s.parks, s.ops ? (double) s.waitMicros / s.ops : 0.0, s.maxWaitMicros,
+			s.ops ? (double) s.lockedMicros / s.ops : 0.0, s.maxLockedMicros);
+	}
+	return result.faults;
+}
+
+// Run the flash lockout protocol with a thread for each core, and report what it costs.
+// A run without the lockout is done first, which should fault, to show the model would notice.
+// Usage: lockmodel [ops] [checkEvery]
+int main(int argc, char **argv) {
+	uint32_t ops        = argc > 1 ? atoi(argv[1]) : 2000;
+	uint32_t checkEvery = argc > 2 ? atoi(argv[2]) : 10;
+	if (!checkEvery) checkEvery = 1;
+	
+	uint64_t unlocked = run("Without lockout", false, ops, checkEvery);
+	uint64_t locked   = run("With lockout", true, ops, checkEvery);
+	if (locked) {
+		printf("Error: the victim ran from flash while it was written\n");
+		return 1;
+	}
+	if (!unlocked) printf("Warning: the victim never ran into a flash write without the lockout\n");
+	return 0;
+}
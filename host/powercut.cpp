@@ -0,0 +1,273 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include "flash_bd.hpp"
+#include "ftl_bd.hpp"
+#include "sim_flash.hpp"
+
+// Versions of every page or block that may be found after power loss.
+class Model {
+	public:
+		// Hashes of the versions of each unit, the last one being the newest.
+		std::vector<std::vector<uint64_t>> allowed;
+		// Size of each unit in bytes.
+		std::size_t unit;
+		
+		Model(const uint8_t *data, std::size_t units, std::size_t _unit): allowed(units), unit(_unit) {
+			for (std::size_t i = 0; i < units; i++) {
+				allowed[i].push_back(hash(data + i * unit));
+			}
+		}
+		
+		// Get the FNV-1a hash of a unit.
+		uint64_t hash(const uint8_t *data) const {
+			uint64_t h = 0xcbf29ce484222325;
+			for (std::size_t i = 0; i < unit; i++) {
+				h = (h ^ data[i]) * 0x100000001b3;
+			}
+			return h;
+		}
+		// Note that units starting at `first` are being written.
+		void write(std::size_t first, std::size_t count, const uint8_t *data) {
+			for (std::size_t i = 0; i < count; i++) {
+				allowed[first + i].push_back(hash(data + i * unit));
+			}
+		}
+		// Note that units starting at `first` are durable, so only their newest version may be found.
+		void settle(std::size_t first, std::size_t count) {
+			for (std::size_t i = first; i < first + count; i++) {
+				allowed[i].erase(allowed[i].begin(), allowed[i].end() - 1);
+			}
+		}
+		// Check whether a unit holds one of the versions it may hold.
+		bool matches(std::size_t index, const uint8_t *data) const {
+			uint64_t h = hash(data);
+			for (uint64_t v: allowed[index]) {
+				if (v == h) return true;
+			}
+			return false;
+		}
+};
+
+// Saved stdout while the block devices' messages are hidden.
+static int savedStdout = -1;
+
+// Hide or show the messages printed while mounting, which are expected after power loss.
+static void quiet(bool on) {
+	fflush(stdout);
+	if (on) {
+		savedStdout = dup(1);
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, 1);
+		close(null);
+	} else {
+		dup2(savedStdout, 1);
+		close(savedStdout);
+	}
+}
+
+// Fill a buffer with the data for a write: random, all 0xFF, or clearing bits of what is there so no erase is needed.
+static void makeData(BlockDevice &dev, uint32_t first, uint32_t count, uint8_t *out) {
+	int kind = rand() % 8;
+	if (kind == 0) dev.readBlocks(first, count, out);
+	for (uint32_t i = 0; i < count * dev.blockSize(); i++) {
+		if (kind == 0) out[i] &= rand();
+		else if (kind == 1) out[i] = 0xff;
+		else out[i] = rand();
+	}
+}
+
+
+
+// Write to a journaled FlashBD until power is lost, syncing every few writes.
+// Pages written since the last finished sync may be found old or new after power loss, all others must be as synced.
+static void flashWorkload(FlashBD &dev, SimFlash &sim, Model &model, uint32_t ops) {
+	uint8_t data[3 * 512];
+	srand(1);
+	for (uint32_t i = 0; i < ops && !sim.powerLost(); i++) {
+		uint32_t first = rand() % dev.blocks();
+		uint32_t count = 1 + rand() % 3;
+		if (count > dev.blocks() - first) count = dev.blocks() - first;
+		makeData(dev, first, count, data);
+		model.write(first * 2, count * 2, data);
+		dev.writeBlocks(first, count, data);
+		
+		// Background flushing leaves commits halfway, to be finished by the next write or sync.
+		if (i % 10 == 9) {
+			dev.sync();
+			if (!sim.powerLost()) model.settle(0, model.allowed.size());
+		} else if (i % 4 == 3) {
+			dev.flushSome(0);
+		}
+	}
+	dev.sync();
+}
+
+// Cut power at every flash operation of a workload on a journaled FlashBD, and check what is there after remounting.
+// Every third cut also cuts power again while the interrupted commit is being finished.
+// Returns the number of cuts after which data was lost.
+static uint32_t checkFlash(uint32_t ops) {
+	const uint32_t dataSize = 64 * 1024;
+	const uint32_t journal  = 4;
+	
+	// Most sectors start with data in them, so writing them needs an erase; the last few start blank.
+	SimFlash base(dataSize + (journal + 1) * 4096);
+	std::vector<uint8_t> image(dataSize, 0xff);
+	srand(7);
+	for (uint32_t i = 0; i < dataSize - 4 * 4096; i++) image[i] = rand();
+	base.load(0, image.data(), image.size());
+	
+	// A run without power loss tells how many operations there are to cut.
+	uint64_t total;
+	{
+		SimFlash sim = base;
+		Model    model(image.data(), dataSize / 256, 256);
+		FlashBD  dev(sim, 512, 0, sim.size(), 16, journal);
+		uint64_t start = sim.operations();
+		flashWorkload(dev, sim, model, ops);
+		total = sim.operations() - start;
+	}
+	
+	uint32_t failed  = 0;
+	uint32_t excused = 0;
+	for (uint64_t cut = 0; cut < total; cut++) {
+		SimFlash sim = base;
+		Model    model(image.data(), dataSize / 256, 256);
+		{
+			FlashBD dev(sim, 512, 0, sim.size(), 16, journal);
+			sim.cutPower(cut);
+			flashWorkload(dev, sim, model, ops);
+		}
+		sim.restorePower();
+		
+		// A page being programmed may be left partly written, but only that one.
+		bool     torn    = !sim.tornOpErase() && sim.tornOpOffset() < dataSize;
+		uint32_t tornEnd = sim.tornOpOffset() + sim.tornOpLength();
+		
+		quiet(true);
+		if (cut % 3 == 0) {
+			sim.cutPower(cut % 7);
+			FlashBD dev(sim, 512, 0, sim.size(), 16, journal);
+			sim.restorePower();
+		}
+		FlashBD dev(sim, 512, 0, sim.size(), 16, journal);
+		std::vector<uint8_t> found(dataSize);
+		FileError ec = dev.readBlocks(0, dataSize / 512, found.data());
+		quiet(false);
+		
+		if (ec != FileError::OK) {
+			printf("Cut at operation %llu: FlashBD doesn't mount\n", (unsigned long long) cut);
+			failed ++;
+			continue;
+		}
+		uint32_t bad = 0;
+		for (uint32_t page = 0; page < dataSize / 256; page++) {
+			if (model.matches(page, found.data() + page * 256)) continue;
+			if (torn && page * 256 >= sim.tornOpOffset() && page * 256 < tornEnd) {
+				excused ++;
+				continue;
+			}
+			if (!bad) printf("Cut at operation %llu: page %u doesn't match any version since the last sync\n", (unsigned long long) cut, page);
+			bad ++;
+		}
+		if (bad) failed ++;
+	}
+	
+	printf("FlashBD journaled: %llu cut points, %u lost data, %u torn pages\n", (unsigned long long) total, failed, excused);
+	return failed;
+}
+
+
+
+// Write to an FtlBD until power is lost.
+// Every write is durable once it returns, so only the blocks of the write in progress may be found old or new.
+static void ftlWorkload(FtlBD &dev, SimFlash &sim, Model &model, uint32_t ops) {
+	uint8_t data[3 * 512];
+	srand(2);
+	for (uint32_t i = 0; i < ops && !sim.powerLost(); i++) {
+		uint32_t first = rand() % dev.blocks();
+		uint32_t count = 1 + rand() % 3;
+		if (count > dev.blocks() - first) count = dev.blocks() - first;
+		for (uint32_t j = 0; j < count * 512; j++) data[j] = rand();
+		model.write(first, count, data);
+		if (dev.writeBlocks(first, count, data) == FileError::OK && !sim.powerLost()) model.settle(first, count);
+	}
+}
+
+// Cut power at every flash operation of a workload on an FtlBD, and check what is there after remounting.
+// Returns the number of cuts after which data was lost.
+static uint32_t checkFtl(uint32_t ops) {
+	// Start with every block written.
+	SimFlash base(64 * 1024);
+	std::vector<uint8_t> image;
+	{
+		FtlBD dev(base, 0, base.size());
+		image.resize(dev.blocks() * 512);
+		srand(8);
+		for (uint8_t &b: image) b = rand();
+		dev.writeBlocks(0, dev.blocks(), image.data());
+	}
+	uint32_t blocks = image.size() / 512;
+	
+	uint64_t total;
+	{
+		SimFlash sim = base;
+		Model    model(image.data(), blocks, 512);
+		FtlBD    dev(sim, 0, sim.size());
+		uint64_t start = sim.operations();
+		ftlWorkload(dev, sim, model, ops);
+		total = sim.operations() - start;
+	}
+	
+	uint32_t failed = 0;
+	for (uint64_t cut = 0; cut < total; cut++) {
+		SimFlash sim = base;
+		Model    model(image.data(), blocks, 512);
+		{
+			FtlBD dev(sim, 0, sim.size());
+			sim.cutPower(cut);
+			ftlWorkload(dev, sim, model, ops);
+		}
+		sim.restorePower();
+		
+		quiet(true);
+		FtlBD dev(sim, 0, sim.size());
+		std::vector<uint8_t> found(image.size());
+		FileError ec = dev.readBlocks(0, blocks, found.data());
+		quiet(false);
+		
+		if (ec != FileError::OK) {
+			printf("Cut at operation %llu: FtlBD doesn't mount\n", (unsigned long long) cut);
+			failed ++;
+			continue;
+		}
+		uint32_t bad = 0;
+		for (uint32_t block = 0; block < blocks; block++) {
+			if (model.matches(block, found.data() + block * 512)) continue;
+			if (!bad) printf("Cut at operation %llu: block %u doesn't match the last write to it\n", (unsigned long long) cut, block);
+			bad ++;
+		}
+		if (bad) failed ++;
+	}
+	
+	printf("FtlBD: %llu cut points, %u lost data\n", (unsigned long long) total, failed);
+	return failed;
+}
+
+
+
+// Cut power at every flash operation of a random workload, remount, and check that nothing was lost that shouldn't be.
+// Done for the journaled FlashBD, whose interrupted commits are finished on mount, and for FtlBD, whose mapping is rebuilt.
+// Usage: powercut [ops]
+int main(int argc, char **argv) {
+	uint32_t ops = argc > 1 ? atoi(argv[1]) : 200;
+	
+	uint32_t failed = checkFlash(ops) + checkFtl(ops);
+	if (failed) {
+		printf("Error: data was lost to power loss\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+
+# Packs a disk image into the block-compressed format read by CompressedBD.
+#
+# Layout (all integers little-endian uint32):
+#   magic "BDZ1", image size, chunk size, chunk count
+#   chunk offsets[chunk count + 1], relative to the end of the offset table
+#   chunk data
+# A chunk of length 0 is all zeroes, a chunk of length `chunk size` is stored as-is,
+# and anything else is an LZ4 block.
+
+from sys import argv, stderr
+import struct
+
+MIN_MATCH  = 4
+# The LZ4 block format requires the last 5 bytes to be literals,
+# and the last match to start at least 12 bytes before the end.
+LAST_LITERALS = 5
+MF_LIMIT      = 12
+MAX_OFFSET    = 65535
+
+def lz4_length(out: bytearray, length: int):
+	"""Appends the extra length bytes for a length that did not fit in the token."""
+	while length >= 255:
+		out.append(255)
+		length -= 255
+	out.append(length)
+
+def lz4_sequence(out: bytearray, literals: bytes, offset: int, match: int):
+	"""Appends one sequence; a match of 0 means this is the final, literal-only sequence."""
+	lit_tok   = min(len(literals), 15)
+	match_tok = min(match - MIN_MATCH, 15) if match else 0
+	out.append(lit_tok << 4 | match_tok)
+	if lit_tok == 15: lz4_length(out, len(literals) - 15)
+	out += literals
+	if not match: return
+	out += struct.pack("<H", offset)
+	if match_tok == 15: lz4_length(out, match - MIN_MATCH - 15)
+
+def lz4_compress(src: bytes) -> bytes:
+	"""Greedy LZ4 block compressor with a single-entry hash table."""
+	out    = bytearray()
+	table  = {}
+	anchor = 0
+	i      = 0
+	limit  = len(src) - MF_LIMIT
+	
+	while i < limit:
+		key  = src[i:i+MIN_MATCH]
+		cand = table.get(key)
+		table[key] = i
+		if cand is None or i - cand > MAX_OFFSET:
+			i += 1
+			continue
+		
+		# Extend the match as far as the format allows.
+		match = MIN_MATCH
+		while i + match < len(src) - LAST_LITERALS and src[cand + match] == src[i + match]:
+			match += 1
+		
+		lz4_sequence(out, src[anchor:i], i - cand, match)
+		i += match
+		anchor = i
+	
+	lz4_sequence(out, src[anchor:], 0, 0)
+	return bytes(out)
+
+def pack(image: bytes, chunk_size: int) -> bytes:
+	"""Packs an image into independently compressed chunks."""
+	count   = (len(image) + chunk_size - 1) // chunk_size
+	chunks  = []
+	
+	for i in range(count):
+		raw = image[i*chunk_size:(i+1)*chunk_size]
+		raw = raw + bytes(chunk_size - len(raw))
+		if raw == bytes(chunk_size):
+			# All zeroes is stored as nothing at all.
+			chunks.append(b"")
+			continue
+		comp = lz4_compress(raw)
+		# Incompressible data is stored as-is.
+		chunks.append(comp if len(comp) < chunk_size else raw)
+	
+	offsets = [0]
+	for c in chunks: offsets.append(offsets[-1] + len(c))
+	
+	out  = b"BDZ1" + struct.pack("<III", len(image), chunk_size, count)
+	out += struct.pack("<%dI" % len(offsets), *offsets)
+	out += b"".join(chunks)
+	return out
+
+if __name__ == "__main__":
+	if len(argv) < 3:
+		print("Usage: %s <image> <output> [chunk size]" % argv[0], file=stderr)
+		exit(1)
+	chunk_size = int(argv[3]) if len(argv) > 3 else 4096
+	if chunk_size & (chunk_size - 1):
+		print("Chunk size must be a power of 2", file=stderr)
+		exit(1)
+	
+	with open(argv[1], "rb") as fd:
+		image = fd.read()
+	packed = pack(image, chunk_size)
+	with open(argv[2], "wb") as fd:
+		fd.write(packed)
+	
+	print("%s: %d -> %d bytes (%d%%)" % (argv[1], len(image), len(packed), len(packed) * 100 // max(len(image), 1)))
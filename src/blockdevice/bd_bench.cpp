@@ -0,0 +1,224 @@
+
+#include "bd_bench.hpp"
+#include "bd_clock.hpp"
+#include <string.h>
+#include <vector>
+
+
+
+// Get the bucket a sample falls in.
+int LatencyHistogram::bucketOf(uint64_t ns) {
+	if (ns < SUB) return ns;
+	
+	// Find the power of two.
+	int pow = 63 - __builtin_clzll(ns);
+	// The next two bits select the sub-bucket.
+	int sub = (ns >> (pow - 2)) & (SUB - 1);
+	
+	int bucket = (pow - 1) * SUB + sub;
+	if (bucket >= POW * SUB) bucket = POW * SUB - 1;
+	return bucket;
+}
+
+// Get the largest value that falls in a bucket.
+uint64_t LatencyHistogram::bucketMax(int bucket) {
+	if (bucket < SUB) return bucket;
+	
+	int pow = bucket / SUB + 1;
+	int sub = bucket % SUB;
+	return ((uint64_t) (SUB + sub + 1) << (pow - 2)) - 1;
+}
+
+// Remove all samples.
+void LatencyHistogram::clear() {
+	memset(buckets, 0, sizeof(buckets));
+	samples = 0;
+	_max    = 0;
+	_total  = 0;
+}
+
+// Add a sample.
+void LatencyHistogram::add(uint64_t ns) {
+	buckets[bucketOf(ns)] ++;
+	samples ++;
+	_total += ns;
+	if (ns > _max) _max = ns;
+}
+
+// Get an upper bound on the given percentile (0-100).
+uint64_t LatencyHistogram::percentile(uint32_t pct) const {
+	if (!samples) return 0;
+	
+	// Number of samples that must be at or below the result.
+	uint64_t need = ((uint64_t) samples * pct + 99) / 100;
+	if (need < 1) need = 1;
+	
+	uint64_t seen = 0;
+	for (int i = 0; i < POW * SUB; i++) {
+		seen += buckets[i];
+		if (seen >= need) {
+			uint64_t max = bucketMax(i);
+			return max < _max ? max : _max;
+		}
+	}
+	return _max;
+}
+
+
+
+// Access patterns of the standard workloads.
+enum class Pattern {
+	// Consecutive reads.
+	SEQ_READ,
+	// Reads at random aligned offsets.
+	RAND_READ,
+	// Consecutive writes.
+	SEQ_WRITE,
+	// Writes at random aligned offsets.
+	RAND_WRITE,
+	// Read, modify and write back at random aligned offsets.
+	RMW,
+	// Writes at random aligned offsets, each followed by a sync.
+	SYNC_WRITE,
+};
+
+// A standard workload.
+struct Workload {
+	// Name to print.
+	const char *name;
+	// Access pattern.
+	Pattern pattern;
+	// Bytes per operation.
+	uint32_t size;
+};
+
+// The standard workloads.
+static const Workload workloads[] = {
+	{ "seq read",   Pattern::SEQ_READ,   1    },
+	{ "seq read",   Pattern::SEQ_READ,   32   },
+	{ "seq read",   Pattern::SEQ_READ,   512  },
+	{ "seq read",   Pattern::SEQ_READ,   4096 },
+	{ "rand read",  Pattern::RAND_READ,  1    },
+	{ "rand read",  Pattern::RAND_READ,  32   },
+	{ "rand read",  Pattern::RAND_READ,  512  },
+	{ "rand read",  Pattern::RAND_READ,  4096 },
+	{ "seq write",  Pattern::SEQ_WRITE,  1    },
+	{ "seq write",  Pattern::SEQ_WRITE,  32   },
+	{ "seq write",  Pattern::SEQ_WRITE,  512  },
+	{ "seq write",  Pattern::SEQ_WRITE,  4096 },
+	{ "rand write", Pattern::RAND_WRITE, 1    },
+	{ "rand write", Pattern::RAND_WRITE, 32   },
+	{ "rand write", Pattern::RAND_WRITE, 512  },
+	{ "rand write", Pattern::RAND_WRITE, 4096 },
+	{ "rmw",        Pattern::RMW,        32   },
+	{ "rmw",        Pattern::RMW,        512  },
+	{ "sync write", Pattern::SYNC_WRITE, 512  },
+};
+
+// Largest operation size of the standard workloads.
+static const uint32_t maxSize = 4096;
+
+// Small, repeatable random number generator (xorshift32).
+static uint32_t nextRandom(uint32_t &state) {
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+// Whether a pattern writes to the device.
+static bool isWrite(Pattern pattern) {
+	return pattern != Pattern::SEQ_READ && pattern != Pattern::RAND_READ;
+}
+
+// Whether a pattern uses random offsets.
+static bool isRandom(Pattern pattern) {
+	return pattern != Pattern::SEQ_READ && pattern != Pattern::SEQ_WRITE;
+}
+
+// Run a single workload.
+// Returns an error if the workload had to be stopped.
+static FileError runWorkload(BlockDevice &bd, const Workload &work, const BenchConfig &cfg,
+		uint8_t *buf, LatencyHistogram &hist, uint64_t &totalNs) {
+	uint32_t random = cfg.seed ? cfg.seed : 1;
+	uint32_t slots  = bd.bytes() / work.size;
+	if (!slots) return FileError::INVALID_PARAM;
+	
+	hist.clear();
+	uint64_t start = bdNanos();
+	for (uint32_t i = 0; i < cfg.ops; i++) {
+		// Pick the next offset.
+		uint32_t slot   = isRandom(work.pattern) ? nextRandom(random) % slots : i % slots;
+		uint32_t offset = slot * work.size;
+		buf[0] = i;
+		
+		// Do the operation.
+		FileError ec = FileError::OK;
+		uint64_t opStart = bdNanos();
+		switch (work.pattern) {
+			case Pattern::SEQ_READ:
+			case Pattern::RAND_READ:
+				ec = bd.read(offset, buf, work.size);
+				break;
+			case Pattern::SEQ_WRITE:
+			case Pattern::RAND_WRITE:
+				ec = bd.write(offset, buf, work.size);
+				break;
+			case Pattern::RMW:
+				ec = bd.read(offset, buf, work.size);
+				buf[0] ++;
+				if (!ec) ec = bd.write(offset, buf, work.size);
+				break;
+			case Pattern::SYNC_WRITE:
+				ec = bd.write(offset, buf, work.size);
+				if (!ec) ec = bd.sync();
+				break;
+		}
+		hist.add(bdNanos() - opStart);
+		if (ec) return ec;
+	}
+	
+	// Written data only counts once it is on the media.
+	if (isWrite(work.pattern)) {
+		FileError ec = bd.sync();
+		if (ec) return ec;
+	}
+	totalNs = bdNanos() - start;
+	
+	return FileError::OK;
+}
+
+// Run the standard workloads against a block device and print the results.
+// Workloads that the device does not support are reported as such and skipped.
+// Erases are those counted by `bd` itself, so they show up for flash devices but not for caches on top of them.
+void bdBench(BlockDevice &bd, const char *label, const BenchConfig &cfg) {
+	std::vector<uint8_t> buf(maxSize);
+	LatencyHistogram hist;
+	
+	printf("Block device benchmark: %s (%u blocks of %u bytes, %u ops per workload)\n",
+		label, bd.blocks(), bd.blockSize(), cfg.ops);
+	printf("%-10s %5s %12s %10s %10s %10s %8s\n", "workload", "size", "KiB/s", "p50 us", "p99 us", "max us", "erases");
+	
+	for (const Workload &work: workloads) {
+		if (isWrite(work.pattern) && !cfg.writes) continue;
+		if (work.size > bd.bytes()) continue;
+		
+		// Run and report.
+		uint64_t totalNs = 0;
+		uint32_t erases  = bd.ioStats().erases;
+		FileError ec = runWorkload(bd, work, cfg, buf.data(), hist, totalNs);
+		if (ec == FileError::NOT_SUPPORTED || ec == FileError::READ_ONLY) {
+			printf("%-10s %5u  not supported\n", work.name, work.size);
+			continue;
+		} else if (ec) {
+			printf("%-10s %5u  error: %s\n", work.name, work.size, strerror((int) ec));
+			continue;
+		}
+		
+		uint64_t bytes = (uint64_t) cfg.ops * work.size;
+		double kibps = totalNs ? bytes * 1e9 / totalNs / 1024 : 0;
+		printf("%-10s %5u %12.1f %10.2f %10.2f %10.2f %8u\n", work.name, work.size, kibps,
+			hist.percentile(50) / 1000.0, hist.percentile(99) / 1000.0, hist.max() / 1000.0,
+			(unsigned) (bd.ioStats().erases - erases));
+	}
+}
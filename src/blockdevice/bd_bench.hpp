@@ -0,0 +1,61 @@
+
+#pragma once
+
+#include "blockdevice.hpp"
+
+// Log-linear latency histogram.
+// Each power of two of nanoseconds is split into `SUB` buckets.
+class LatencyHistogram {
+	public:
+		// Number of buckets per power of two.
+		static const int SUB = 4;
+		// Number of powers of two covered (up to ~1 hour).
+		static const int POW = 42;
+		
+	protected:
+		// Sample counts per bucket.
+		uint32_t buckets[POW * SUB];
+		// Number of samples.
+		uint32_t samples;
+		// Largest sample.
+		uint64_t _max;
+		// Sum of all samples.
+		uint64_t _total;
+		
+		// Get the bucket a sample falls in.
+		static int bucketOf(uint64_t ns);
+		// Get the largest value that falls in a bucket.
+		static uint64_t bucketMax(int bucket);
+		
+	public:
+		LatencyHistogram() { clear(); }
+		
+		// Remove all samples.
+		void clear();
+		// Add a sample.
+		void add(uint64_t ns);
+		// Get an upper bound on the given percentile (0-100).
+		uint64_t percentile(uint32_t pct) const;
+		// Get the largest sample.
+		uint64_t max() const { return _max; }
+		// Get the sum of all samples.
+		uint64_t total() const { return _total; }
+		// Get the number of samples.
+		uint32_t count() const { return samples; }
+};
+
+// Options for a benchmark run.
+struct BenchConfig {
+	// Operations per workload.
+	uint32_t ops;
+	// Whether to run workloads that write to the device.
+	// This destroys the contents of the device.
+	bool writes;
+	// Seed for the random offsets, so runs are repeatable.
+	uint32_t seed;
+};
+
+// Run the standard workloads against a block device and print the results.
+// Workloads that the device does not support are reported as such and skipped.
+// Erases are those counted by `bd` itself, so they show up for flash devices but not for caches on top of them.
+void bdBench(BlockDevice &bd, const char *label, const BenchConfig &cfg);
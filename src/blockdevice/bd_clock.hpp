@@ -0,0 +1,22 @@
+
+#pragma once
+
+#include <stdint.h>
+
+#if PICO_ON_DEVICE
+#include <pico/time.h>
+
+// Nanoseconds since boot, with microsecond resolution.
+static inline uint64_t bdNanos() {
+	return time_us_64() * 1000;
+}
+#else
+#include <time.h>
+
+// Nanoseconds from a monotonic clock.
+static inline uint64_t bdNanos() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
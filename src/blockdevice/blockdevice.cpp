@@ -1,5 +1,6 @@
 
 #include "blockdevice.hpp"
+#include "bd_clock.hpp"
 #include <string.h>
 
 // Like `memcpy`, but with uint8_t.
@@ -7,77 +8,205 @@ static inline void bytecopy(uint8_t *dest, const uint8_t *src, std::size_t len)
 	memcpy((void *) dest, (const void *) src, len);
 }
 
+// Count a call in `calls` that moves `length` bytes, added to `bytes` if not nullptr.
+BlockDevice::StatScope::StatScope(BlockDevice &_dev, uint32_t BlockStats::*calls, uint64_t BlockStats::*bytes, uint64_t length):
+	dev(_dev), outer(!_dev.statDepth++) {
+	
+	if (!outer) return;
+	dev._stats.*calls += 1;
+	if (bytes) dev._stats.*bytes += length;
+	start = bdNanos();
+}
+
+BlockDevice::StatScope::~StatScope() {
+	if (outer) dev._stats.nanos += bdNanos() - start;
+	dev.statDepth --;
+}
+
+
+
+// Get a pointer to a range of bytes on this device, if the media is memory-mapped.
+// Returns nullptr if the range can't be accessed directly.
+const uint8_t *BlockDevice::mapBytes(off_t offset, std::size_t length) {
+	if (!length) return nullptr;
+	
+	// Map all blocks the range touches.
+	off_t first = offset / _blockSize;
+	off_t last  = (offset + length - 1) / _blockSize;
+	const uint8_t *ptr = map(first, last - first + 1);
+	if (!ptr) return nullptr;
+	
+	return ptr + offset % _blockSize;
+}
+
+// Read `count` consecutive blocks starting at `first`.
+FileError BlockDevice::readBlocks(off_t first, off_t count, uint8_t *out) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, (uint64_t) count * _blockSize);
+	// By default, read them one by one.
+	for (off_t i = 0; i < count; i++) {
+		FileError ec = readBlock(first + i, out + i * _blockSize, _blockSize);
+		if (ec) return ec;
+	}
+	return FileError::OK;
+}
+
+// Write `count` consecutive blocks starting at `first`.
+FileError BlockDevice::writeBlocks(off_t first, off_t count, const uint8_t *in) {
+	StatScope scope(*this, &BlockStats::writes, &BlockStats::bytesWritten, (uint64_t) count * _blockSize);
+	// By default, write them one by one.
+	for (off_t i = 0; i < count; i++) {
+		FileError ec = writeBlock(first + i, in + i * _blockSize, _blockSize);
+		if (ec) return ec;
+	}
+	return FileError::OK;
+}
+
+// Read `count` consecutive blocks starting at `first`, scattered over `iovCount` buffers.
+// The buffer lengths must add up to exactly `count` blocks.
+FileError BlockDevice::readBlocks(off_t first, off_t count, const BlockIOVec *iov, std::size_t iovCount) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, (uint64_t) count * _blockSize);
+	// Check the buffers before touching the media.
+	std::size_t total = 0;
+	for (std::size_t i = 0; i < iovCount; i++) {
+		if (iov[i].length % _blockSize) return FileError::INVALID_PARAM;
+		total += iov[i].length;
+	}
+	if (total != (std::size_t) count * _blockSize) return FileError::INVALID_PARAM;
+	
+	// One contiguous read per buffer.
+	for (std::size_t i = 0; i < iovCount; i++) {
+		off_t n = iov[i].length / _blockSize;
+		FileError ec = readBlocks(first, n, iov[i].data);
+		if (ec) return ec;
+		first += n;
+	}
+	return FileError::OK;
+}
+
+// Write `count` consecutive blocks starting at `first`, gathered from `iovCount` buffers.
+// The buffer lengths must add up to exactly `count` blocks.
+FileError BlockDevice::writeBlocks(off_t first, off_t count, const BlockIOVec *iov, std::size_t iovCount) {
+	StatScope scope(*this, &BlockStats::writes, &BlockStats::bytesWritten, (uint64_t) count * _blockSize);
+	// Check the buffers before touching the media.
+	std::size_t total = 0;
+	for (std::size_t i = 0; i < iovCount; i++) {
+		if (iov[i].length % _blockSize) return FileError::INVALID_PARAM;
+		total += iov[i].length;
+	}
+	if (total != (std::size_t) count * _blockSize) return FileError::INVALID_PARAM;
+	
+	// One contiguous write per buffer.
+	for (std::size_t i = 0; i < iovCount; i++) {
+		off_t n = iov[i].length / _blockSize;
+		FileError ec = writeBlocks(first, n, iov[i].data);
+		if (ec) return ec;
+		first += n;
+	}
+	return FileError::OK;
+}
+
+
+
 // Read a range of bytes from this block device.
 FileError BlockDevice::read(off_t offset, uint8_t *out, std::size_t length) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, length);
+	return readRange(offset, out, length, scratchBlock());
+}
+
+// Write a range of bytes to this block device.
+FileError BlockDevice::write(off_t offset, const uint8_t *in, std::size_t length) {
+	StatScope scope(*this, &BlockStats::writes, &BlockStats::bytesWritten, length);
+	return writeRange(offset, in, length, scratchBlock());
+}
+
+// Read a range of bytes using `scratch` (one block in size) for partial blocks.
+// Whole blocks are read directly into `out`.
+FileError BlockDevice::readRange(off_t offset, uint8_t *out, std::size_t length, uint8_t *scratch) {
 	FileError ec = FileError::OK;
 	if (!length) return ec;
 	
-	// Create a read cache.
-	uint8_t *cache = new uint8_t[_blockSize];
-	
-	// Read first block.
-	off_t error = offset % _blockSize;
 	off_t index = offset / _blockSize;
-	off_t i = _blockSize - error;
-	ec = read(index++, cache, _blockSize);
-	if (ec) goto exit;
-	bytecopy(out + error, cache, _blockSize - error);
+	off_t error = offset % _blockSize;
+	std::size_t i = 0;
+	
+	// Read first block, if it is partial.
+	if (error || length < _blockSize) {
+		std::size_t cpy = _blockSize - error;
+		if (cpy > length) cpy = length;
+		
+		// Skip the scratch block if the media is mapped.
+		const uint8_t *mapped = map(index, 1);
+		if (!mapped) {
+			ec = readBlock(index, scratch, _blockSize);
+			if (ec) return ec;
+			mapped = scratch;
+		}
+		bytecopy(out, mapped + error, cpy);
+		index ++;
+		i += cpy;
+	}
 	
-	// Read intermediate blocks.
-	for (; i <= length - _blockSize; i += _blockSize) {
-		ec = read(index++, cache, _blockSize);
-		if (ec) goto exit;
-		bytecopy(out + i, cache, _blockSize);
+	// Read intermediate blocks in one go.
+	if ((length - i) / _blockSize) {
+		off_t count = (length - i) / _blockSize;
+		ec = readBlocks(index, count, out + i);
+		if (ec) return ec;
+		index += count;
+		i     += count * _blockSize;
 	}
 	
 	// Read last block, if any.
 	if (i < length) {
-		ec = read(index, cache, _blockSize);
-		if (ec) goto exit;
-		bytecopy(out + i, cache, length - i);
+		const uint8_t *mapped = map(index, 1);
+		if (!mapped) {
+			ec = readBlock(index, scratch, _blockSize);
+			if (ec) return ec;
+			mapped = scratch;
+		}
+		bytecopy(out + i, mapped, length - i);
 	}
 	
-	// Clean up.
-	exit:
-	delete[] cache;
 	return ec;
 }
 
-// Write a range of bytes to this block device.
-FileError BlockDevice::write(off_t offset, const uint8_t *in, std::size_t length) {
+// Write a range of bytes using `scratch` (one block in size) for partial blocks.
+// Whole blocks are written directly from `in`.
+FileError BlockDevice::writeRange(off_t offset, const uint8_t *in, std::size_t length, uint8_t *scratch) {
 	FileError ec = FileError::OK;
 	if (!length) return ec;
 	
-	// Create a read cache.
-	uint8_t *cache = new uint8_t[_blockSize];
-	
-	// Modify first block.
-	off_t error = offset % _blockSize;
 	off_t index = offset / _blockSize;
-	off_t i = _blockSize - error;
-	if (error) ec = read(index, cache, _blockSize);
-	if (ec) goto exit;
-	bytecopy(cache + error, in, _blockSize - error);
-	ec = write(index++, cache, _blockSize);
-	if (ec) goto exit;
+	off_t error = offset % _blockSize;
+	std::size_t i = 0;
+	
+	// Modify first block, if it is partial.
+	if (error || length < _blockSize) {
+		std::size_t cpy = _blockSize - error;
+		if (cpy > length) cpy = length;
+		ec = readBlock(index, scratch, _blockSize);
+		if (ec) return ec;
+		bytecopy(scratch + error, in, cpy);
+		ec = writeBlock(index++, scratch, _blockSize);
+		if (ec) return ec;
+		i += cpy;
+	}
 	
-	// Write intermediate blocks.
-	for (; i <= length - _blockSize; i += _blockSize) {
-		ec = write(index++, in + i, _blockSize);
-		if (ec) goto exit;
+	// Write intermediate blocks in one go.
+	if ((length - i) / _blockSize) {
+		off_t count = (length - i) / _blockSize;
+		ec = writeBlocks(index, count, in + i);
+		if (ec) return ec;
+		index += count;
+		i     += count * _blockSize;
 	}
 	
 	// Modify last block, if any.
 	if (i < length) {
-		if (error) ec = read(index, cache, _blockSize);
-		if (ec) goto exit;
-		bytecopy(cache, in, length - i);
-		ec = write(index, cache, _blockSize);
-		if (ec) goto exit;
+		ec = readBlock(index, scratch, _blockSize);
+		if (ec) return ec;
+		bytecopy(scratch, in + i, length - i);
+		ec = writeBlock(index, scratch, _blockSize);
 	}
 	
-	// Clean up.
-	exit:
-	delete[] cache;
 	return ec;
 }
@@ -6,16 +6,74 @@
 
 #include <customio.hpp>
 
+// One buffer of a scatter/gather block transfer.
+struct BlockIOVec {
+	// Data to transfer; not modified when writing.
+	uint8_t *data;
+	// Length in bytes, must be a multiple of the block size.
+	std::size_t length;
+};
+
+// Cumulative I/O statistics of a block device.
+struct BlockStats {
+	// Number of read calls.
+	uint32_t reads;
+	// Number of write calls.
+	uint32_t writes;
+	// Number of sync calls.
+	uint32_t syncs;
+	// Number of bytes read.
+	uint64_t bytesRead;
+	// Number of bytes written.
+	uint64_t bytesWritten;
+	// Number of sectors erased, for media that must be erased before writing.
+	uint32_t erases;
+	// Number of accesses served from a cache, for devices that have one.
+	uint32_t cacheHits;
+	// Nanoseconds spent in read, write and sync calls.
+	uint64_t nanos;
+};
+
 class BlockDevice {
 	public:
 		// Block/byte offset/index type.
 		using off_t = uint32_t;
 		
 	protected:
+		// Counts one read, write or sync call in `_stats`, timing it until the end of the scope.
+		// Calls made while another call on the same device is being counted are not counted again.
+		class StatScope {
+			protected:
+				// Device the call is made on.
+				BlockDevice &dev;
+				// Whether this is the outermost call, the only one that is counted.
+				bool outer;
+				// Time at which the call started.
+				uint64_t start;
+				
+			public:
+				// Count a call in `calls` that moves `length` bytes, added to `bytes` if not nullptr.
+				StatScope(BlockDevice &dev, uint32_t BlockStats::*calls, uint64_t BlockStats::*bytes = nullptr, uint64_t length = 0);
+				~StatScope();
+		};
+		
+		// I/O statistics of this device.
+		BlockStats _stats{};
+		// Number of `StatScope`s currently active on this device.
+		uint8_t statDepth = 0;
+		
 		// Block size.
 		off_t _blockSize;
 		// Number of blocks.
 		off_t _blocks;
+		// Scratch block for partial block accesses in `read` and `write`.
+		std::vector<uint8_t> scratch;
+		
+		// Get the scratch block, which is only (re)allocated if the block size grew.
+		uint8_t *scratchBlock() {
+			if (scratch.size() < _blockSize) scratch.resize(_blockSize);
+			return scratch.data();
+		}
 		
 		// Default constructor.
 		BlockDevice() {}
@@ -32,14 +90,38 @@ class BlockDevice {
 		// Write a single block to this device.
 		// This function may fail if length != blockSize.
 		virtual FileError writeBlock(off_t index, const uint8_t *in, std::size_t length) = 0;
+		// Read `count` consecutive blocks starting at `first`.
+		virtual FileError readBlocks(off_t first, off_t count, uint8_t *out);
+		// Write `count` consecutive blocks starting at `first`.
+		virtual FileError writeBlocks(off_t first, off_t count, const uint8_t *in);
+		// Read `count` consecutive blocks starting at `first`, scattered over `iovCount` buffers.
+		// The buffer lengths must add up to exactly `count` blocks.
+		virtual FileError readBlocks(off_t first, off_t count, const BlockIOVec *iov, std::size_t iovCount);
+		// Write `count` consecutive blocks starting at `first`, gathered from `iovCount` buffers.
+		// The buffer lengths must add up to exactly `count` blocks.
+		virtual FileError writeBlocks(off_t first, off_t count, const BlockIOVec *iov, std::size_t iovCount);
 		// Force any cached writes to be written to the media immediately.
 		// You should call this occasionally to prevent data loss and also every time before shutdown.
 		virtual FileError sync() = 0;
 		
+		// Get a pointer to `count` consecutive blocks starting at `index`, if the media is memory-mapped.
+		// Returns nullptr if the blocks can't be accessed directly, in which case readBlock should be used instead.
+		// The pointer is only valid until the next write or sync on this device.
+		virtual const uint8_t *map(off_t, off_t) { return nullptr; }
+		// Get a pointer to a range of bytes on this device, if the media is memory-mapped.
+		// Returns nullptr if the range can't be accessed directly.
+		const uint8_t *mapBytes(off_t offset, std::size_t length);
+		
 		// Read a range of bytes from this block device.
 		virtual FileError read(off_t offset, uint8_t *out, std::size_t length);
 		// Write a range of bytes to this block device.
 		virtual FileError write(off_t offset, const uint8_t *in, std::size_t length);
+		// Read a range of bytes using `scratch` (one block in size) for partial blocks.
+		// Whole blocks are read directly into `out`.
+		FileError readRange(off_t offset, uint8_t *out, std::size_t length, uint8_t *scratch);
+		// Write a range of bytes using `scratch` (one block in size) for partial blocks.
+		// Whole blocks are written directly from `in`.
+		FileError writeRange(off_t offset, const uint8_t *in, std::size_t length, uint8_t *scratch);
 		
 		// Get the size of a block in this device.
 		// Must be a power of two.
@@ -53,4 +135,9 @@ class BlockDevice {
 		off_t bytes() const { return blocks() * blockSize(); }
 		// Get the block an index lies within.
 		off_t offsetToBlock(off_t offset) { return offset / blockSize(); }
+		
+		// Get the I/O statistics of this device.
+		const BlockStats &ioStats() const { return _stats; }
+		// Reset the I/O statistics of this device to zero.
+		void resetIoStats() { _stats = BlockStats{}; }
 };
@@ -0,0 +1,240 @@
+
+#include "cached_bd.hpp"
+#include <string.h>
+
+
+
+// Find the slot holding a block, or -1 if not cached.
+int CachedBD::find(off_t index) {
+	for (std::size_t i = 0; i < slots.size(); i++) {
+		if (slots[i].index == index) return i;
+	}
+	return -1;
+}
+
+// Get a slot for a block, evicting the least recently used one if needed.
+// Only loads the block from the underlying device if `load` is true.
+FileError CachedBD::acquire(off_t index, bool load, std::size_t &slot) {
+	// Already cached?
+	int found = find(index);
+	if (found >= 0) {
+		cacheStats.hits ++;
+		_stats.cacheHits ++;
+		slot = found;
+		slots[slot].lastUse = ++useCounter;
+		return FileError::OK;
+	}
+	cacheStats.misses ++;
+	
+	// Prefer an empty slot, otherwise take the least recently used.
+	slot = 0;
+	for (std::size_t i = 0; i < slots.size(); i++) {
+		if (slots[i].index == NONE) {
+			slot = i;
+			break;
+		}
+		if (slots[i].lastUse < slots[slot].lastUse) slot = i;
+	}
+	
+	// Evict the current contents.
+	if (slots[slot].index != NONE) {
+		FileError ec = writeBack(slot);
+		if (ec) return ec;
+		cacheStats.evictions ++;
+		slots[slot].index = NONE;
+	}
+	
+	// Load the new block.
+	if (load) {
+		FileError ec = lower->readBlock(index, slotData(slot), _blockSize);
+		if (ec) return ec;
+	}
+	slots[slot].index   = index;
+	slots[slot].lastUse = ++useCounter;
+	slots[slot].dirty   = false;
+	
+	return FileError::OK;
+}
+
+// Write a slot back to the underlying device if dirty.
+FileError CachedBD::writeBack(std::size_t slot) {
+	if (!slots[slot].dirty) return FileError::OK;
+	
+	FileError ec = lower->writeBlock(slots[slot].index, slotData(slot), _blockSize);
+	if (ec) return ec;
+	slots[slot].dirty = false;
+	cacheStats.writebacks ++;
+	
+	return FileError::OK;
+}
+
+// Recompute the slot count from the budget and drop all slots.
+void CachedBD::reset() {
+	std::size_t count = budget / _blockSize;
+	if (count < 1) count = 1;
+	
+	slots.assign(count, Slot{NONE, 0, false});
+	storage.resize(count * _blockSize);
+	useCounter = 0;
+}
+
+
+
+// Wrap a block device in a write-back LRU cache of at most `budget` bytes of block data.
+// The cache always holds at least one block.
+CachedBD::CachedBD(std::unique_ptr<BlockDevice> _lower, std::size_t _budget):
+	valid(true), lower(std::move(_lower)), budget(_budget) {
+	
+	// Check parameters.
+	if (!lower) {
+		printf("Error: CachedBD has no underlying device\n");
+		valid = false;
+		return;
+	}
+	
+	// Mirror the underlying geometry.
+	_blockSize = lower->blockSize();
+	_blocks    = lower->blocks();
+	
+	// Preallocate all the slots.
+	reset();
+	resetStats();
+}
+
+// Writes back any dirty blocks.
+CachedBD::~CachedBD() {
+	if (valid) sync();
+}
+
+
+
+// Read a single block from this device.
+// This function may fail if length != blockSize.
+FileError CachedBD::readBlock(off_t index, uint8_t *out, std::size_t length) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, length);
+	if (length % _blockSize) return FileError::INVALID_PARAM;
+	return readBlocks(index, length / _blockSize, out);
+}
+
+// Write a single block to this device.
+// This function may fail if length != blockSize.
+FileError CachedBD::writeBlock(off_t index, const uint8_t *in, std::size_t length) {
+	StatScope scope(*this, &BlockStats::writes, &BlockStats::bytesWritten, length);
+	if (length % _blockSize) return FileError::INVALID_PARAM;
+	return writeBlocks(index, length / _blockSize, in);
+}
+
+// Read `count` consecutive blocks starting at `first`.
+FileError CachedBD::readBlocks(off_t first, off_t count, uint8_t *out) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, (uint64_t) count * _blockSize);
+	if (!valid) return FileError::DISK_ERROR;
+	if (first + count > _blocks) return FileError::INVALID_PARAM;
+	
+	if (count > 1 && count > slots.size() / 2) {
+		// Large reads would flush the entire cache, so they bypass it.
+		FileError ec = lower->readBlocks(first, count, out);
+		if (ec) return ec;
+		cacheStats.misses += count;
+		
+		// Dirty blocks in the cache are newer than the media.
+		for (std::size_t i = 0; i < slots.size(); i++) {
+			if (slots[i].dirty && slots[i].index >= first && slots[i].index < first + count) {
+				memcpy(out + (slots[i].index - first) * _blockSize, slotData(i), _blockSize);
+			}
+		}
+		return FileError::OK;
+	}
+	
+	// Small reads go through the cache.
+	for (off_t i = 0; i < count; i++) {
+		std::size_t slot;
+		FileError ec = acquire(first + i, true, slot);
+		if (ec) return ec;
+		memcpy(out + i * _blockSize, slotData(slot), _blockSize);
+	}
+	
+	return FileError::OK;
+}
+
+// Write `count` consecutive blocks starting at `first`.
+FileError CachedBD::writeBlocks(off_t first, off_t count, const uint8_t *in) {
+	StatScope scope(*this, &BlockStats::writes, &BlockStats::bytesWritten, (uint64_t) count * _blockSize);
+	if (!valid) return FileError::DISK_ERROR;
+	if (first + count > _blocks) return FileError::INVALID_PARAM;
+	
+	if (count > 1 && count > slots.size() / 2) {
+		// Large writes would flush the entire cache, so they are written through.
+		FileError ec = lower->writeBlocks(first, count, in);
+		if (ec) return ec;
+		cacheStats.misses += count;
+		
+		// Update any cached copies, which are now clean.
+		for (std::size_t i = 0; i < slots.size(); i++) {
+			if (slots[i].index != NONE && slots[i].index >= first && slots[i].index < first + count) {
+				memcpy(slotData(i), in + (slots[i].index - first) * _blockSize, _blockSize);
+				slots[i].dirty = false;
+			}
+		}
+		return FileError::OK;
+	}
+	
+	// Small writes stay in the cache until evicted or synced.
+	for (off_t i = 0; i < count; i++) {
+		std::size_t slot;
+		FileError ec = acquire(first + i, false, slot);
+		if (ec) return ec;
+		memcpy(slotData(slot), in + i * _blockSize, _blockSize);
+		slots[slot].dirty = true;
+	}
+	
+	return FileError::OK;
+}
+
+// Write back all dirty blocks, then sync the underlying device.
+FileError CachedBD::sync() {
+	StatScope scope(*this, &BlockStats::syncs);
+	if (!valid) return FileError::DISK_ERROR;
+	
+	for (std::size_t i = 0; i < slots.size(); i++) {
+		FileError ec = writeBack(i);
+		if (ec) return ec;
+	}
+	
+	return lower->sync();
+}
+
+// Get a pointer to `count` consecutive blocks starting at `index` from the underlying device.
+// Fails if any of the blocks are dirty in the cache.
+const uint8_t *CachedBD::map(off_t index, off_t count) {
+	if (!valid) return nullptr;
+	
+	for (std::size_t i = 0; i < slots.size(); i++) {
+		if (slots[i].dirty && slots[i].index >= index && slots[i].index < index + count) {
+			return nullptr;
+		}
+	}
+	
+	return lower->map(index, count);
+}
+
+
+
+// Attempt to resize the block size.
+// This writes back and drops the entire cache.
+FileError CachedBD::setBlockSize(off_t newSize) {
+	if (!valid) return FileError::DISK_ERROR;
+	
+	// Everything needs to be on the media first.
+	FileError ec = sync();
+	if (ec) return ec;
+	
+	ec = lower->setBlockSize(newSize);
+	if (ec) return ec;
+	
+	// Apply changes.
+	_blockSize = lower->blockSize();
+	_blocks    = lower->blocks();
+	reset();
+	
+	return FileError::OK;
+}
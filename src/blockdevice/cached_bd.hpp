@@ -0,0 +1,99 @@
+
+#pragma once
+
+#include "blockdevice.hpp"
+#include <memory>
+#include <vector>
+
+class CachedBD: public BlockDevice {
+	public:
+		// Cache usage counters.
+		struct Stats {
+			// Number of block accesses served from the cache.
+			uint32_t hits;
+			// Number of block accesses that went to the underlying device.
+			uint32_t misses;
+			// Number of blocks dropped to make room for others.
+			uint32_t evictions;
+			// Number of dirty blocks written to the underlying device.
+			uint32_t writebacks;
+		};
+		
+	protected:
+		// Marks a slot as not holding any block.
+		static const off_t NONE = (off_t) -1;
+		
+		// Bookkeeping for one cache slot.
+		struct Slot {
+			// Block index held in this slot, or NONE.
+			off_t index;
+			// Value of `useCounter` when this slot was last used.
+			uint32_t lastUse;
+			// Whether the block has writes not yet on the underlying device.
+			bool dirty;
+		};
+		
+		// It valid?
+		bool valid;
+		// The underlying block device.
+		std::unique_ptr<BlockDevice> lower;
+		// Memory budget in bytes.
+		std::size_t budget;
+		// Cache slots.
+		std::vector<Slot> slots;
+		// Block data for all slots, preallocated at construction.
+		std::vector<uint8_t> storage;
+		// Incremented on every access, used for LRU replacement.
+		uint32_t useCounter;
+		// Cache usage counters.
+		Stats cacheStats;
+		
+		// Get the data for a slot.
+		uint8_t *slotData(std::size_t slot) { return storage.data() + slot * _blockSize; }
+		// Find the slot holding a block, or -1 if not cached.
+		int find(off_t index);
+		// Get a slot for a block, evicting the least recently used one if needed.
+		// Only loads the block from the underlying device if `load` is true.
+		FileError acquire(off_t index, bool load, std::size_t &slot);
+		// Write a slot back to the underlying device if dirty.
+		FileError writeBack(std::size_t slot);
+		// Recompute the slot count from the budget and drop all slots.
+		void reset();
+		
+	public:
+		CachedBD(): valid(false) {}
+		// Wrap a block device in a write-back LRU cache of at most `budget` bytes of block data.
+		// The cache always holds at least one block.
+		CachedBD(std::unique_ptr<BlockDevice> lower, std::size_t budget);
+		// Writes back any dirty blocks.
+		~CachedBD();
+		
+		// Read a single block from this device.
+		// This function may fail if length != blockSize.
+		FileError readBlock(off_t index, uint8_t *out, std::size_t length);
+		// Write a single block to this device.
+		// This function may fail if length != blockSize.
+		FileError writeBlock(off_t index, const uint8_t *in, std::size_t length);
+		// Read `count` consecutive blocks starting at `first`.
+		FileError readBlocks(off_t first, off_t count, uint8_t *out);
+		// Write `count` consecutive blocks starting at `first`.
+		FileError writeBlocks(off_t first, off_t count, const uint8_t *in);
+		using BlockDevice::readBlocks;
+		using BlockDevice::writeBlocks;
+		// Write back all dirty blocks, then sync the underlying device.
+		FileError sync();
+		// Get a pointer to `count` consecutive blocks starting at `index` from the underlying device.
+		// Fails if any of the blocks are dirty in the cache.
+		const uint8_t *map(off_t index, off_t count);
+		
+		// Attempt to resize the block size.
+		// This writes back and drops the entire cache.
+		FileError setBlockSize(off_t newSize);
+		
+		// Get the cache usage counters.
+		const Stats &stats() const { return cacheStats; }
+		// Reset the cache usage counters.
+		void resetStats() { cacheStats = Stats{0, 0, 0, 0}; }
+		// Get the number of blocks the cache can hold.
+		std::size_t capacity() const { return slots.size(); }
+};
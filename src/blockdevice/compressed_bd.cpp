@@ -0,0 +1,261 @@
+
+#include "compressed_bd.hpp"
+#include <string.h>
+#include "unaligned_access.hpp"
+
+
+
+// Decompress one LZ4 block.
+// Returns false if the data is corrupt or does not decompress to exactly `outLen` bytes.
+static bool lz4Decompress(const uint8_t *in, std::size_t inLen, uint8_t *out, std::size_t outLen) {
+	const uint8_t *ip   = in;
+	const uint8_t *iend = in + inLen;
+	uint8_t       *op   = out;
+	uint8_t       *oend = out + outLen;
+	
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		
+		// Copy the literals.
+		std::size_t lit = token >> 4;
+		if (lit == 15) {
+			uint8_t next;
+			do {
+				if (ip >= iend) return false;
+				next = *ip++;
+				lit += next;
+			} while (next == 255);
+		}
+		if (lit > (std::size_t) (iend - ip) || lit > (std::size_t) (oend - op)) return false;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		
+		// The last sequence has no match.
+		if (ip >= iend) break;
+		
+		// Get the match.
+		if (iend - ip < 2) return false;
+		std::size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!offset || offset > (std::size_t) (op - out)) return false;
+		std::size_t len = (token & 15) + 4;
+		if ((token & 15) == 15) {
+			uint8_t next;
+			do {
+				if (ip >= iend) return false;
+				next = *ip++;
+				len += next;
+			} while (next == 255);
+		}
+		if (len > (std::size_t) (oend - op)) return false;
+		
+		// Copy the match; it may overlap the output when repeating a short pattern.
+		const uint8_t *match = op - offset;
+		if (offset >= len) {
+			memcpy(op, match, len);
+			op += len;
+		} else {
+			while (len--) *op++ = *match++;
+		}
+	}
+	
+	return op == oend;
+}
+
+
+
+// Get the compressed data of a chunk.
+const uint8_t *CompressedBD::chunkData(uint32_t chunk, uint32_t &length) const {
+	uint32_t start = unaligned_read(*(const uint32_t *) (offsets + chunk * 4));
+	uint32_t end   = unaligned_read(*(const uint32_t *) (offsets + chunk * 4 + 4));
+	length = end - start;
+	return payload + start;
+}
+
+// Get a chunk's decompressed data, decompressing it into the cache if needed.
+// Returns nullptr if the chunk is corrupt.
+const uint8_t *CompressedBD::getChunk(uint32_t chunk) {
+	// Stored uncompressed chunks can be used as-is.
+	uint32_t length;
+	const uint8_t *data = chunkData(chunk, length);
+	if (length == chunkSize) return data;
+	
+	// Look in the cache, keeping track of the least recently used slot.
+	std::size_t slot = 0;
+	for (std::size_t i = 0; i < slotChunk.size(); i++) {
+		if (slotChunk[i] == chunk) {
+			slotUse[i] = ++useCounter;
+			_stats.cacheHits ++;
+			return storage.data() + i * chunkSize;
+		}
+		if (slotUse[i] < slotUse[slot]) slot = i;
+	}
+	
+	// Decompress into the least recently used slot.
+	uint8_t *out = storage.data() + slot * chunkSize;
+	slotChunk[slot] = NONE;
+	if (!length) {
+		// Empty chunks are all zeroes.
+		memset(out, 0, chunkSize);
+	} else if (!lz4Decompress(data, length, out, chunkSize)) {
+		printf("Error: CompressedBD chunk %u is corrupt\n", chunk);
+		return nullptr;
+	}
+	slotChunk[slot] = chunk;
+	slotUse[slot]   = ++useCounter;
+	
+	return out;
+}
+
+
+
+// Serve a compressed image with `blockSize` byte blocks, caching up to `cacheChunks` decompressed chunks.
+// The image must stay in memory (e.g. flash) for the lifetime of the device.
+// Block size must be a power of 2.
+CompressedBD::CompressedBD(const uint8_t *data, std::size_t length, off_t blockSize, std::size_t cacheChunks) {
+	_blockSize = blockSize;
+	_blocks    = 0;
+	valid      = true;
+	useCounter = 0;
+	
+	// Check the header.
+	if (length < 20 || unaligned_read(*(const uint32_t *) data) != MAGIC) {
+		printf("Error: CompressedBD image has no valid header\n");
+		valid = false;
+		return;
+	}
+	imageSize  = unaligned_read(*(const uint32_t *) (data + 4));
+	chunkSize  = unaligned_read(*(const uint32_t *) (data + 8));
+	chunkCount = unaligned_read(*(const uint32_t *) (data + 12));
+	offsets    = data + 16;
+	
+	// Check parameters.
+	if (!chunkSize || (chunkSize & (chunkSize - 1)) || (uint64_t) chunkCount * chunkSize < imageSize) {
+		printf("Error: CompressedBD image has invalid chunk geometry\n");
+		valid = false;
+		return;
+	}
+	// The offset table size is computed in 64 bits, as a bogus chunk count could overflow it.
+	uint64_t indexSize = ((uint64_t) chunkCount + 1) * 4;
+	if (indexSize > length - 16) {
+		printf("Error: CompressedBD image is truncated\n");
+		valid = false;
+		return;
+	}
+	payload = offsets + indexSize;
+	
+	// Every chunk must lie within the image, so the offsets must never decrease.
+	uint32_t prev = 0;
+	for (uint32_t i = 0; i <= chunkCount; i++) {
+		uint32_t offset = unaligned_read(*(const uint32_t *) (offsets + i * 4));
+		if (offset < prev) {
+			printf("Error: CompressedBD chunk %u has a decreasing offset\n", i);
+			valid = false;
+			return;
+		}
+		prev = offset;
+	}
+	if (prev > data + length - payload) {
+		printf("Error: CompressedBD image is truncated\n");
+		valid = false;
+		return;
+	}
+	if (!_blockSize || (_blockSize & (_blockSize - 1))) {
+		printf("Error: CompressedBD block size (%u) is not a power of 2\n", _blockSize);
+		valid = false;
+	}
+	if (imageSize % _blockSize) {
+		printf("Error: CompressedBD size (%u) not aligned to %u\n", imageSize, _blockSize);
+		valid = false;
+	}
+	_blocks = imageSize / _blockSize;
+	
+	// Preallocate the chunk cache.
+	if (cacheChunks < 1) cacheChunks = 1;
+	slotChunk.assign(cacheChunks, NONE);
+	slotUse.assign(cacheChunks, 0);
+	storage.resize(cacheChunks * chunkSize);
+}
+
+
+
+// Read a single block from this device.
+// This function may fail if length != blockSize.
+FileError CompressedBD::readBlock(off_t index, uint8_t *out, std::size_t length) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, length);
+	if (index + length / _blockSize > _blocks) return FileError::INVALID_PARAM;
+	return read(index * _blockSize, out, length);
+}
+
+// Read `count` consecutive blocks starting at `first`.
+FileError CompressedBD::readBlocks(off_t first, off_t count, uint8_t *out) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, (uint64_t) count * _blockSize);
+	if (first + count > _blocks) return FileError::INVALID_PARAM;
+	return read(first * _blockSize, out, count * _blockSize);
+}
+
+// Get a pointer to `count` consecutive blocks starting at `index`.
+// Only works for blocks that lie within one chunk that is stored uncompressed.
+const uint8_t *CompressedBD::map(off_t index, off_t count) {
+	if (!valid || !count) return nullptr;
+	if (index + count > _blocks) return nullptr;
+	
+	// Must be within one chunk.
+	uint32_t start = index * _blockSize;
+	uint32_t chunk = start / chunkSize;
+	if ((start + count * _blockSize - 1) / chunkSize != chunk) return nullptr;
+	
+	// Must be stored as-is.
+	uint32_t length;
+	const uint8_t *data = chunkData(chunk, length);
+	if (length != chunkSize) return nullptr;
+	
+	return data + start % chunkSize;
+}
+
+// Read a range of bytes from this block device.
+FileError CompressedBD::read(off_t offset, uint8_t *out, std::size_t length) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, length);
+	if (!valid) return FileError::DISK_ERROR;
+	if (offset + length > imageSize) return FileError::INVALID_PARAM;
+	
+	// Copy out of one chunk at a time.
+	while (length) {
+		const uint8_t *chunk = getChunk(offset / chunkSize);
+		if (!chunk) return FileError::DISK_ERROR;
+		
+		std::size_t start = offset % chunkSize;
+		std::size_t cpy   = chunkSize - start;
+		if (cpy > length) cpy = length;
+		memcpy(out, chunk + start, cpy);
+		
+		offset += cpy;
+		out    += cpy;
+		length -= cpy;
+	}
+	
+	return FileError::OK;
+}
+
+// Attempt to resize the block size.
+// This operation may fail if unaligned or the block size is unobtainable.
+FileError CompressedBD::setBlockSize(off_t newSize) {
+	if (!valid) return FileError::DISK_ERROR;
+	
+	// Check parameters.
+	if (!newSize || (newSize & (newSize - 1))) {
+		printf("Error: CompressedBD new block size (%u) is not a power of 2\n", newSize);
+		return FileError::INVALID_PARAM;
+	}
+	if (imageSize % newSize) {
+		printf("Error: CompressedBD size (%u) not aligned to %u\n", imageSize, newSize);
+		return FileError::INVALID_PARAM;
+	}
+	
+	// Apply changes.
+	_blocks = imageSize / newSize;
+	_blockSize = newSize;
+	
+	return FileError::OK;
+}
@@ -0,0 +1,80 @@
+
+#pragma once
+
+#include "blockdevice.hpp"
+#include <vector>
+
+// Read-only block device serving a block-compressed image, as made by `lz4pack.py`.
+// The image is split into independently compressed chunks; recently used chunks are kept decompressed in RAM.
+class CompressedBD: public BlockDevice {
+	public:
+		// Magic value at the start of a compressed image ("BDZ1").
+		static constexpr uint32_t MAGIC = 0x315a4442;
+		
+	protected:
+		// Marks a cache slot as not holding any chunk.
+		static constexpr uint32_t NONE = (uint32_t) -1;
+		
+		// It valid?
+		bool valid;
+		// Uncompressed size in bytes.
+		uint32_t imageSize;
+		// Uncompressed size of a chunk.
+		uint32_t chunkSize;
+		// Number of chunks.
+		uint32_t chunkCount;
+		// Chunk offset table; `chunkCount + 1` unaligned entries.
+		const uint8_t *offsets;
+		// Start of the chunk data.
+		const uint8_t *payload;
+		
+		// Chunk held in each cache slot, or NONE.
+		std::vector<uint32_t> slotChunk;
+		// Value of `useCounter` when each cache slot was last used.
+		std::vector<uint32_t> slotUse;
+		// Decompressed data of all cache slots.
+		std::vector<uint8_t> storage;
+		// Incremented on every access, used for LRU replacement.
+		uint32_t useCounter;
+		
+		// Get the compressed data of a chunk.
+		const uint8_t *chunkData(uint32_t chunk, uint32_t &length) const;
+		// Get a chunk's decompressed data, decompressing it into the cache if needed.
+		// Returns nullptr if the chunk is corrupt.
+		const uint8_t *getChunk(uint32_t chunk);
+		
+	public:
+		CompressedBD(): valid(false) {}
+		// Serve a compressed image with `blockSize` byte blocks, caching up to `cacheChunks` decompressed chunks.
+		// The image must stay in memory (e.g. flash) for the lifetime of the device.
+		// Block size must be a power of 2.
+		CompressedBD(const uint8_t *data, std::size_t length, off_t blockSize, std::size_t cacheChunks = 2);
+		
+		// Read a single block from this device.
+		// This function may fail if length != blockSize.
+		FileError readBlock(off_t index, uint8_t *out, std::size_t length);
+		// Write a single block to this device.
+		// This function may fail if length != blockSize.
+		FileError writeBlock(off_t index, const uint8_t *in, std::size_t length) { return FileError::NOT_SUPPORTED; }
+		// Read `count` consecutive blocks starting at `first`.
+		FileError readBlocks(off_t first, off_t count, uint8_t *out);
+		// Write `count` consecutive blocks starting at `first`.
+		FileError writeBlocks(off_t first, off_t count, const uint8_t *in) { return FileError::NOT_SUPPORTED; }
+		using BlockDevice::readBlocks;
+		using BlockDevice::writeBlocks;
+		// Force any cached writes to be written to the media immediately.
+		// You should call this occasionally to prevent data loss and also every time before shutdown.
+		FileError sync() { return FileError::OK; }
+		// Get a pointer to `count` consecutive blocks starting at `index`.
+		// Only works for blocks that lie within one chunk that is stored uncompressed.
+		const uint8_t *map(off_t index, off_t count);
+		
+		// Read a range of bytes from this block device.
+		FileError read(off_t offset, uint8_t *out, std::size_t length);
+		// Write a range of bytes to this block device.
+		FileError write(off_t offset, const uint8_t *in, std::size_t length) { return FileError::NOT_SUPPORTED; }
+		
+		// Attempt to resize the block size.
+		// This operation may fail if unaligned or the block size is unobtainable.
+		FileError setBlockSize(off_t newSize);
+};
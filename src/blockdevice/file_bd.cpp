@@ -0,0 +1,179 @@
+
+#include "file_bd.hpp"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+
+// Open an image file as a block device.
+// The image size is rounded down to a multiple of the block size.
+// Block size must be a power of 2.
+// If `useMmap` is false or mapping fails, `pread` and `pwrite` are used instead.
+FileBD::FileBD(const char *path, off_t blockSize, bool _writable, bool useMmap):
+	valid(true), writable(_writable), mapped(nullptr) {
+	_blockSize = blockSize;
+	_blocks    = 0;
+	
+	// Check parameters.
+	if (!_blockSize || (_blockSize & (_blockSize - 1))) {
+		printf("Error: FileBD block size (%u) is not a power of 2\n", _blockSize);
+		valid = false;
+	}
+	
+	// Open the image.
+	fd = open(path, writable ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		printf("Error: FileBD can't open %s: %s\n", path, strerror(errno));
+		valid = false;
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st)) {
+		printf("Error: FileBD can't stat %s: %s\n", path, strerror(errno));
+		valid = false;
+		return;
+	}
+	if (valid) _blocks = st.st_size / _blockSize;
+	
+	// Try to map it into memory.
+	if (valid && useMmap && _blocks) {
+		void *ptr = mmap(nullptr, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+		if (ptr != MAP_FAILED) {
+			mapped     = (uint8_t *) ptr;
+			mappedSize = st.st_size;
+		}
+	}
+}
+
+// Unmaps and closes the image.
+FileBD::~FileBD() {
+	if (mapped) munmap(mapped, mappedSize);
+	if (fd >= 0) close(fd);
+}
+
+
+
+// Read a single block from this device.
+// This function may fail if length != blockSize.
+FileError FileBD::readBlock(off_t index, uint8_t *out, std::size_t length) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, length);
+	if (index + length / _blockSize > _blocks) return FileError::INVALID_PARAM;
+	return read(index * _blockSize, out, length);
+}
+
+// Write a single block to this device.
+// This function may fail if length != blockSize.
+FileError FileBD::writeBlock(off_t index, const uint8_t *in, std::size_t length) {
+	StatScope scope(*this, &BlockStats::writes, &BlockStats::bytesWritten, length);
+	if (index + length / _blockSize > _blocks) return FileError::INVALID_PARAM;
+	return write(index * _blockSize, in, length);
+}
+
+// Read `count` consecutive blocks starting at `first`.
+FileError FileBD::readBlocks(off_t first, off_t count, uint8_t *out) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, (uint64_t) count * _blockSize);
+	if (first + count > _blocks) return FileError::INVALID_PARAM;
+	return read(first * _blockSize, out, count * _blockSize);
+}
+
+// Write `count` consecutive blocks starting at `first`.
+FileError FileBD::writeBlocks(off_t first, off_t count, const uint8_t *in) {
+	StatScope scope(*this, &BlockStats::writes, &BlockStats::bytesWritten, (uint64_t) count * _blockSize);
+	if (first + count > _blocks) return FileError::INVALID_PARAM;
+	return write(first * _blockSize, in, count * _blockSize);
+}
+
+// Force any cached writes to be written to the media immediately.
+// You should call this occasionally to prevent data loss and also every time before shutdown.
+FileError FileBD::sync() {
+	StatScope scope(*this, &BlockStats::syncs);
+	if (!valid) return FileError::DISK_ERROR;
+	if (!writable) return FileError::OK;
+	
+	if (mapped && msync(mapped, bytes(), MS_SYNC)) return FileError::DISK_ERROR;
+	if (fsync(fd)) return FileError::DISK_ERROR;
+	return FileError::OK;
+}
+
+// Get a pointer to `count` consecutive blocks starting at `index`.
+// Only works if the image is memory-mapped.
+const uint8_t *FileBD::map(off_t index, off_t count) {
+	if (!valid || !mapped) return nullptr;
+	if (index + count > _blocks) return nullptr;
+	
+	return mapped + index * _blockSize;
+}
+
+
+
+// Read a range of bytes from this block device.
+FileError FileBD::read(off_t offset, uint8_t *out, std::size_t length) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, length);
+	if (!valid) return FileError::DISK_ERROR;
+	if (offset + length > bytes()) return FileError::INVALID_PARAM;
+	
+	if (mapped) {
+		memcpy(out, mapped + offset, length);
+		return FileError::OK;
+	}
+	
+	// Keep going until everything is read.
+	while (length) {
+		ssize_t res = pread(fd, out, length, offset);
+		if (res <= 0) return FileError::DISK_ERROR;
+		out    += res;
+		offset += res;
+		length -= res;
+	}
+	return FileError::OK;
+}
+
+// Write a range of bytes to this block device.
+FileError FileBD::write(off_t offset, const uint8_t *in, std::size_t length) {
+	StatScope scope(*this, &BlockStats::writes, &BlockStats::bytesWritten, length);
+	if (!valid) return FileError::DISK_ERROR;
+	if (!writable) return FileError::READ_ONLY;
+	if (offset + length > bytes()) return FileError::INVALID_PARAM;
+	
+	if (mapped) {
+		memcpy(mapped + offset, in, length);
+		return FileError::OK;
+	}
+	
+	// Keep going until everything is written.
+	while (length) {
+		ssize_t res = pwrite(fd, in, length, offset);
+		if (res <= 0) return FileError::DISK_ERROR;
+		in     += res;
+		offset += res;
+		length -= res;
+	}
+	return FileError::OK;
+}
+
+
+
+// Attempt to resize the block size.
+// This operation may fail if unaligned or the block size is unobtainable.
+FileError FileBD::setBlockSize(off_t newSize) {
+	if (!valid) return FileError::DISK_ERROR;
+	
+	// Check parameters.
+	if (!newSize || (newSize & (newSize - 1))) {
+		printf("Error: FileBD new block size (%u) is not a power of 2\n", newSize);
+		return FileError::INVALID_PARAM;
+	}
+	if (_blocks * _blockSize % newSize) {
+		printf("Error: FileBD size (%u) not aligned to %u\n", _blocks * _blockSize, newSize);
+		return FileError::INVALID_PARAM;
+	}
+	
+	// Apply changes.
+	_blocks = _blocks * _blockSize / newSize;
+	_blockSize = newSize;
+	
+	return FileError::OK;
+}
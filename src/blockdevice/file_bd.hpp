@@ -0,0 +1,60 @@
+
+#pragma once
+
+#include "blockdevice.hpp"
+
+// Block device backed by an image file on a POSIX host.
+// Only meant for running the filesystem stack off-target, e.g. for profiling.
+class FileBD: public BlockDevice {
+	protected:
+		// It valid?
+		bool valid;
+		// Opened for writing?
+		bool writable;
+		// File descriptor of the image.
+		int fd;
+		// The image mapped into memory, if `mmap` was used.
+		uint8_t *mapped;
+		// Size of the memory mapping.
+		std::size_t mappedSize;
+		
+	public:
+		FileBD(): valid(false), fd(-1), mapped(nullptr) {}
+		// Open an image file as a block device.
+		// The image size is rounded down to a multiple of the block size.
+		// Block size must be a power of 2.
+		// If `useMmap` is false or mapping fails, `pread` and `pwrite` are used instead.
+		FileBD(const char *path, off_t blockSize, bool writable = false, bool useMmap = true);
+		// Unmaps and closes the image.
+		~FileBD();
+		FileBD(const FileBD &) = delete;
+		FileBD &operator=(const FileBD &) = delete;
+		
+		// Read a single block from this device.
+		// This function may fail if length != blockSize.
+		FileError readBlock(off_t index, uint8_t *out, std::size_t length);
+		// Write a single block to this device.
+		// This function may fail if length != blockSize.
+		FileError writeBlock(off_t index, const uint8_t *in, std::size_t length);
+		// Read `count` consecutive blocks starting at `first`.
+		FileError readBlocks(off_t first, off_t count, uint8_t *out);
+		// Write `count` consecutive blocks starting at `first`.
+		FileError writeBlocks(off_t first, off_t count, const uint8_t *in);
+		using BlockDevice::readBlocks;
+		using BlockDevice::writeBlocks;
+		// Force any cached writes to be written to the media immediately.
+		// You should call this occasionally to prevent data loss and also every time before shutdown.
+		FileError sync();
+		// Get a pointer to `count` consecutive blocks starting at `index`.
+		// Only works if the image is memory-mapped.
+		const uint8_t *map(off_t index, off_t count);
+		
+		// Read a range of bytes from this block device.
+		FileError read(off_t offset, uint8_t *out, std::size_t length);
+		// Write a range of bytes to this block device.
+		FileError write(off_t offset, const uint8_t *in, std::size_t length);
+		
+		// Attempt to resize the block size.
+		// This operation may fail if unaligned or the block size is unobtainable.
+		FileError setBlockSize(off_t newSize);
+};
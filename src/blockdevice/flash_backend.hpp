@@ -0,0 +1,22 @@
+
+#pragma once
+
+#include <stdint.h>
+
+// Raw NOR flash for the flash block devices to sit on.
+// Erasing sets all bits to 1, and programming can only clear bits.
+// Offsets are from the start of the flash.
+class FlashBackend {
+	public:
+		virtual ~FlashBackend() = default;
+		
+		// Get a pointer to read the flash at `offset` directly.
+		virtual const uint8_t *data(uint32_t offset) = 0;
+		// Erase `length` bytes at `offset`, both multiples of 4096.
+		virtual void erase(uint32_t offset, uint32_t length) = 0;
+		// Program `length` bytes at `offset`, both multiples of 256.
+		// The data may not be in the flash itself.
+		virtual void program(uint32_t offset, const uint8_t *in, uint32_t length) = 0;
+		// Get the time in microseconds, including time the flash was busy.
+		virtual uint64_t micros() = 0;
+};
@@ -3,123 +3,668 @@
 
 #include <stdio.h>
 #include <string.h>
-#include <pico/stdlib.h>
-#include <hardware/sync.h>
+#if PICO_ON_DEVICE
+#include "pico_flash.hpp"
+#endif
 
 
 
-// Sync a specific write cache entry.
-bool FlashBD::sync(WriteCache::iterator entry) {
-	off_t index = entry->first;
-	Page &data  = entry->second;
+// Check whether a range of flash or memory is blank (all 0xFF).
+static bool isBlank(const uint8_t *data, std::size_t length) {
+	const uint32_t *words = (const uint32_t *) data;
+	
+	// Blank means every bit is set.
+	uint32_t all = 0xffffffff;
+	for (std::size_t i = 0; i < length / 4; i++) {
+		all &= words[i];
+	}
+	return all == 0xffffffff;
+}
+
+// Table for computing the CRC-32 (as used by zlib) a byte at a time.
+struct CrcTable {
+	uint32_t entries[256];
+	
+	constexpr CrcTable(): entries() {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t crc = i;
+			for (int j = 0; j < 8; j++) {
+				crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+			}
+			entries[i] = crc;
+		}
+	}
+};
+static constexpr CrcTable crcTable;
+
+// Compute the CRC-32 (as used by zlib) of some data.
+// Passing the CRC of the data before it continues that.
+static uint32_t crc32(const uint8_t *data, std::size_t length, uint32_t crc = 0) {
+	crc = ~crc;
+	for (std::size_t i = 0; i < length; i++) {
+		crc = (crc >> 8) ^ crcTable.entries[(crc ^ data[i]) & 255];
+	}
+	return ~crc;
+}
+
+
+
+// Find the write cache slot holding a page.
+// Returns -1 if the page is not cached.
+int FlashBD::findSlot(off_t page) const {
+	std::size_t mask = pageIndex.size() - 1;
+	
+	// The index is never more than half full, so there is always an empty entry to stop at.
+	for (std::size_t pos = indexHome(page);; pos = (pos + 1) & mask) {
+		int16_t slot = pageIndex[pos];
+		if (slot == EMPTY) return -1;
+		if (slotPage[slot] == page) return slot;
+	}
+}
+
+// Take an unused write cache slot for a page and add it to the index.
+// There must be an unused slot.
+int FlashBD::addSlot(off_t page) {
+	std::size_t mask = pageIndex.size() - 1;
+	
+	// Take a slot.
+	int16_t slot = freeSlots.back();
+	freeSlots.pop_back();
+	slotPage[slot] = page;
+	
+	// Put it in the first empty entry of the page's probe sequence.
+	std::size_t pos = indexHome(page);
+	while (pageIndex[pos] != EMPTY) pos = (pos + 1) & mask;
+	pageIndex[pos] = slot;
+	
+	return slot;
+}
+
+// Remove a write cache slot from the index and mark it unused.
+void FlashBD::removeSlot(int slot) {
+	std::size_t mask = pageIndex.size() - 1;
+	
+	// Find the slot's entry.
+	std::size_t hole = indexHome(slotPage[slot]);
+	while (pageIndex[hole] != slot) hole = (hole + 1) & mask;
+	pageIndex[hole] = EMPTY;
+	
+	// Shift later entries of the cluster back into the hole, so no probe sequence is broken.
+	for (std::size_t pos = (hole + 1) & mask; pageIndex[pos] != EMPTY; pos = (pos + 1) & mask) {
+		// An entry may only move if the hole lies between its home and its current position.
+		std::size_t home = indexHome(slotPage[pageIndex[pos]]);
+		if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+			pageIndex[hole] = pageIndex[pos];
+			pageIndex[pos]  = EMPTY;
+			hole            = pos;
+		}
+	}
+	
+	// Mark the slot as unused.
+	slotPage[slot] = NONE;
+	freeSlots.push_back(slot);
+}
+
+
+
+// Count the write cache slots holding pages of a sector.
+int FlashBD::cachedInSector(off_t sector) const {
+	int count = 0;
+	for (off_t i = sector * 16; i < sector * 16 + 16; i++) {
+		if (findSlot(i) >= 0) count ++;
+	}
+	return count;
+}
+
+// Check whether a page in flash is blank (all 0xFF), which is as good as erased.
+bool FlashBD::pageBlank(off_t page) const {
+	return isBlank(flash->data(page * 256 + _base), 256);
+}
+
+// Mark the blank pages in a sector as erased, if the sector hasn't been checked yet.
+void FlashBD::checkSector(off_t sector) {
+	if (checkedSectors[sector]) return;
+	checkedSectors[sector] = true;
+	
+	for (off_t i = sector * 16; i < sector * 16 + 16; i++) {
+		if (!erasedPages[i]) erasedPages[i] = pageBlank(i);
+	}
+}
+
+// Check whether a page can be programmed over what is in flash now, i.e. no bit goes from 0 to 1.
+bool FlashBD::programmable(off_t page, const uint8_t *data) const {
+	const uint32_t *cur = (const uint32_t *) flash->data(page * 256 + _base);
+	const uint32_t *in  = (const uint32_t *) data;
+	
+	// Programming can only clear bits, so every set bit must already be set.
+	for (int i = 0; i < 64; i++) {
+		if ((cur[i] & in[i]) != in[i]) return false;
+	}
+	return true;
+}
+
+// Check whether flushing a sector needs it erased, because a cached page can't be programmed over what is in flash.
+bool FlashBD::needsErase(off_t sector) {
+	// Pages that are already blank needn't be erased or preserved.
+	checkSector(sector);
+	
+	for (off_t i = sector * 16; i < sector * 16 + 16; i++) {
+		int slot = findSlot(i);
+		if (slot >= 0 && !erasedPages[i] && !programmable(i, pageData(slot))) return true;
+	}
+	return false;
+}
+
+// Move all cached pages of a sector into the sector buffer and start flushing it.
+// The sector is erased once if any of them needs it, otherwise the pages are programmed as-is.
+// Pages that aren't erased can still be programmed over if no bit goes from 0 to 1.
+// When journaled, a sector that needs erasing is committed through the journal instead.
+// No flash is written yet, except to finish the previous flush.
+bool FlashBD::beginFlush(off_t sector) {
+	if (!finishFlush()) return false;
+	
+	uint8_t *buf   = sectorBuf.data();
+	off_t    first = sector * 16;
+	uint16_t pages = 0;
+	bool     needErase = needsErase(sector);
+	
+	// When journaled, sectors are only erased by committing them through the journal.
+	// Programming pages needs no journal, as only the page being programmed can be damaged by power loss.
+	if (journalSlots && needErase) {
+		beginCommit(sector);
+		return true;
+	}
+	
+	// Collect the cached pages.
+	for (off_t i = 0; i < 16; i++) {
+		int slot = findSlot(first + i);
+		if (slot < 0) continue;
+		memcpy(buf + i * 256, pageData(slot), 256);
+		removeSlot(slot);
+		pages |= 1 << i;
+	}
+	
+	// Erasing also loses the unerased pages that weren't cached, so they are preserved in the sector buffer.
+	// The erased ones are read from the sector buffer too until the erase is done.
+	if (needErase) {
+		for (off_t i = 0; i < 16; i++) {
+			if ((pages >> i) & 1) continue;
+			if (erasedPages[first + i]) {
+				memset(buf + i * 256, 0xff, 256);
+				continue;
+			}
+			readPage(first + i, buf + i * 256);
+			pages |= 1 << i;
+		}
+	}
 	
-	// Ensure page is erased before trying to write.
-	if (!erasedPages[index]) {
-		bool res = erase(index / 16);
-		if (!res) return false;
+	flushing   = sector;
+	flushErase = needErase;
+	flushPages = pages;
+	return true;
+}
+
+// Do one step of the current flush, which is one flash operation at most:
+// erase the sector, program a run of at most `maxPages` pages, or one step of a commit.
+bool FlashBD::flushStep(off_t maxPages) {
+	// A commit is applied by flushing its sectors one by one, its other states are steps of their own.
+	// Moving on to the next sector writes nothing, so it is done right away.
+	while (commitState == APPLYING && flushing == NONE) {
+		if (!nextApply()) return false;
+	}
+	if (commitState != IDLE && commitState != APPLYING) return commitStep(maxPages);
+	if (flushing == NONE) return true;
+	
+	uint8_t *buf   = sectorBuf.data();
+	off_t    first = flushing * 16;
+	off_t    addr  = _base + flushing * 4096;
+	
+	if (flushErase) {
+		flash->erase(addr, 4096);
+		_stats.erases ++;
+		for (off_t i = 0; i < 16; i++) {
+			erasedPages[first + i] = true;
+		}
+		flushErase = false;
+		
+	} else if (flushPages) {
+		// Program the first run of consecutive pages left.
+		off_t i = 0;
+		while (!((flushPages >> i) & 1)) i ++;
+		off_t end = i;
+		while (end < 16 && end - i < maxPages && ((flushPages >> end) & 1)) {
+			erasedPages[first + end] = false;
+			flushPages &= ~(1 << end);
+			end ++;
+		}
+		
+		flash->program(addr + i * 256, buf + i * 256, (end - i) * 256);
 	}
 	
-	// Write data to the page now.
-	off_t addr = _base + index * 256;
-	uint32_t irqs = save_and_disable_interrupts();
-	flash_range_program(addr, data, 256);
-	restore_interrupts(irqs);
+	if (!flushErase && !flushPages) flushing = NONE;
+	return true;
+}
+
+// Finish the current flush, if any.
+bool FlashBD::finishFlush() {
+	while (flushBusy()) {
+		if (!flushStep(16)) return false;
+	}
+	return true;
+}
+
+// Write all cached pages of a sector to flash and remove them from the cache.
+bool FlashBD::flushSector(off_t sector) {
+	return beginFlush(sector) && finishFlush();
+}
+
+// Find the sector that gets the most pages written per erase, or NONE if nothing is cached.
+FlashBD::off_t FlashBD::fullestSector() const {
+	off_t best      = NONE;
+	int   bestCount = 0;
+	for (off_t page: slotPage) {
+		if (page == NONE) continue;
+		off_t sector = page / 16;
+		if (sector == best) continue;
+		int count = cachedInSector(sector);
+		if (count > bestCount || (count == bestCount && sector < best)) {
+			best      = sector;
+			bestCount = count;
+		}
+	}
+	return best;
+}
+
+// Make sure there is an unused write cache slot, moving the sector with the most cached pages out if needed.
+// That sector's flush is only started, so the write that needs room doesn't wait for all of it.
+bool FlashBD::makeRoom() {
+	if (!freeSlots.empty()) return true;
+	return beginFlush(fullestSector());
+}
+
+// Start flushing the image in the sector buffer to a sector, erasing it only if some page can't be programmed over what is there.
+// Only pages that differ are programmed, so doing this again after being interrupted gives the same result.
+void FlashBD::beginApply(off_t sector) {
+	const uint8_t *buf   = sectorBuf.data();
+	off_t          first = sector * 16;
+	uint16_t       pages = 0;
+	bool           erase = false;
+	
+	for (off_t i = 0; i < 16; i++) {
+		erase |= !programmable(first + i, buf + i * 256);
+	}
+	for (off_t i = 0; i < 16; i++) {
+		// Cached pages that are the same as the image are written by this.
+		int slot = findSlot(first + i);
+		if (slot >= 0 && !memcmp(pageData(slot), buf + i * 256, 256)) removeSlot(slot);
+		
+		if (erase ? !isBlank(buf + i * 256, 256) : memcmp(flash->data(_base + (first + i) * 256), buf + i * 256, 256) != 0) {
+			pages |= 1 << i;
+		}
+	}
+	
+	checkSector(sector);
+	flushing   = (erase || pages) ? sector : NONE;
+	flushErase = erase;
+	flushPages = pages;
+}
+
+// Get the CRC of a commit record, which covers everything but the CRC itself and the done marker.
+uint32_t FlashBD::recordCrc(const JournalRecord &record) {
+	JournalRecord tmp = record;
+	tmp.crc  = 0xffffffff;
+	tmp.done = 0xffffffff;
+	return crc32((const uint8_t *) &tmp, sizeof(tmp));
+}
+
+// Erase the log sector the log head is at the start of, unless it is blank.
+// Returns true if it was erased.
+bool FlashBD::eraseLog() {
+	if (logHead % 16 || isBlank(flash->data(logAddr(logHead)), 4096)) return false;
+	flash->erase(logAddr(logHead), 4096);
+	_stats.erases ++;
+	return true;
+}
+
+// Start committing sectors that need erasing through the journal, starting with `sector`.
+// Other such cached sectors are taken along, sharing the commit record.
+// The new image of `sector` goes into the sector buffer, the others stay in the write cache until they are staged.
+// No flash is written yet; `flushStep` stages the images in the log, writes the commit record,
+// writes the sectors to where they belong and marks the record done, one flash operation at a time.
+void FlashBD::beginCommit(off_t sector) {
+	JournalRecord *record   = (JournalRecord *) recordBuf;
+	off_t          logPages = (journalSlots + 1) * 16;
+	memset(recordBuf, 0xff, sizeof(recordBuf));
+	record->magic = JOURNAL_MAGIC;
+	record->seq   = logSeq;
+	record->count = 0;
+	
+	// The log always keeps a sector free, so erasing the sector it enters never loses the newest commit record.
+	record->sectors[record->count++] = sector;
+	for (off_t page: slotPage) {
+		if (record->count >= journalSlots - 1) break;
+		if (page == NONE) continue;
+		bool dup = false;
+		for (off_t i = 0; i < record->count; i++) dup |= record->sectors[i] == page / 16;
+		if (!dup && needsErase(page / 16)) record->sectors[record->count++] = page / 16;
+	}
+	for (off_t i = 0; i < record->count; i++) {
+		record->pages[i] = (logHead + i * 16) % logPages;
+	}
 	
-	// Remove iterator from the map.
-	writeCache.erase(entry);
+	// The first sector makes room in the write cache right away.
+	uint8_t *buf   = sectorBuf.data();
+	off_t    first = sector * 16;
+	memcpy(buf, flash->data(_base + sector * 4096), 4096);
+	for (off_t i = 0; i < 16; i++) {
+		int slot = findSlot(first + i);
+		if (slot < 0) continue;
+		memcpy(buf + i * 256, pageData(slot), 256);
+		removeSlot(slot);
+	}
+	record->sectorCrc[0] = crc32(buf, 4096);
+	
+	// Its pages are read from the sector buffer, but it isn't written until the commit is recorded.
+	flushing    = sector;
+	flushErase  = false;
+	flushPages  = 0xffff;
+	commitState = STAGING;
+	commitIndex = 0;
+	commitPage  = 0;
+	commitCrc   = 0;
+}
+
+// Do one step of staging, recording or finishing the commit in progress.
+bool FlashBD::commitStep(off_t maxPages) {
+	JournalRecord *record   = (JournalRecord *) recordBuf;
+	off_t          logPages = (journalSlots + 1) * 16;
 	
+	if (commitState == STAGING) {
+		if (eraseLog()) return true;
+		
+		off_t run = 1;
+		if (commitIndex == 0) {
+			// The first sector is staged from the sector buffer, in runs that stop at the end of a log sector.
+			run = 16 - commitPage;
+			if (run > maxPages) run = maxPages;
+			if (run > 16 - logHead % 16) run = 16 - logHead % 16;
+			flash->program(logAddr(logHead), sectorBuf.data() + commitPage * 256, run * 256);
+			
+		} else {
+			// The others are staged a page at a time from the write cache, or from flash through RAM.
+			uint8_t        copy[256];
+			const uint8_t *data = copy;
+			int            slot = findSlot(record->sectors[commitIndex] * 16 + commitPage);
+			if (slot >= 0) {
+				data = pageData(slot);
+			} else {
+				readPage(record->sectors[commitIndex] * 16 + commitPage, copy);
+			}
+			commitCrc = crc32(data, 256, commitCrc);
+			flash->program(logAddr(logHead), data, 256);
+		}
+		
+		logHead     = (logHead + run) % logPages;
+		commitPage += run;
+		if (commitPage == 16) {
+			if (commitIndex) record->sectorCrc[commitIndex] = commitCrc;
+			commitIndex ++;
+			commitPage = 0;
+			commitCrc  = 0;
+			if (commitIndex == record->count) commitState = RECORDING;
+		}
+		return true;
+		
+	} else if (commitState == RECORDING) {
+		if (eraseLog()) return true;
+		
+		// From here on, the commit survives power loss.
+		record->crc = recordCrc(*record);
+		flash->program(logAddr(logHead), recordBuf, 256);
+		commitRecord = logHead;
+		logHead      = (logHead + 1) % logPages;
+		logSeq ++;
+		
+		// The image of the first sector is still in the sector buffer.
+		commitState = APPLYING;
+		commitIndex = 0;
+		beginApply(record->sectors[0]);
+		return true;
+		
+	} else {
+		// Programming over the record only clears the done marker.
+		uint8_t done[256];
+		memcpy(done, recordBuf, sizeof(done));
+		((JournalRecord *) done)->done = 0;
+		flash->program(logAddr(commitRecord), done, 256);
+		commitState = IDLE;
+		return true;
+	}
+}
+
+// Load the image of a sector of a commit record from the log into the sector buffer.
+// Fails if it doesn't match its CRC, in which case the commit can't be applied.
+bool FlashBD::loadImage(const JournalRecord &record, off_t index) {
+	uint8_t *buf      = sectorBuf.data();
+	off_t    logPages = (journalSlots + 1) * 16;
+	
+	// Flash can't be programmed from flash, so the image is copied to RAM.
+	for (off_t i = 0; i < 16; i++) {
+		memcpy(buf + i * 256, flash->data(logAddr((record.pages[index] + i) % logPages)), 256);
+	}
+	if (crc32(buf, 4096) != record.sectorCrc[index]) {
+		printf("Error: FlashBD journal image of sector %u is corrupt\n", record.sectors[index]);
+		return false;
+	}
 	return true;
 }
 
-// Sync, but only for when the writeCache is too big.
-bool FlashBD::syncExcess() {
-	// Make sure the write cache isn't too big.
-	while (writeCache.size() > cacheLimit) {
-		// We keep taking the iterator because `sync(iter)` removes from the map.
-		auto iter = writeCache.begin();
-		if (!sync(iter)) return false;
+// Start applying the next sector of the commit in progress, or finish it once all are written.
+bool FlashBD::nextApply() {
+	const JournalRecord *record = (const JournalRecord *) recordBuf;
+	off_t                next   = commitIndex + 1;
+	
+	if (next == record->count) {
+		commitState = FINISHING;
+		return true;
 	}
 	
+	// The commit stays here, not done, if the image can't be loaded.
+	if (!loadImage(*record, next)) return false;
+	commitIndex = next;
+	beginApply(record->sectors[next]);
 	return true;
 }
 
-// Get or copy a page to cache, then return the iterator for the entry.
-FlashBD::WriteCache::iterator FlashBD::encache(off_t page) {
-	auto iter = writeCache.find(page);
+// Finish a commit that was interrupted by power loss, and find where the log continues.
+// Fails if the commit can't be applied.
+bool FlashBD::recoverJournal() {
+	JournalRecord *record   = (JournalRecord *) recordBuf;
+	off_t          logPages = (journalSlots + 1) * 16;
+	
+	// The valid record with the highest sequence number is the newest.
+	// Torn records fail their CRC and were never acted upon.
+	off_t    newest = NONE;
+	uint32_t seq    = 0;
+	for (off_t i = 0; i < logPages; i++) {
+		const JournalRecord *found = (const JournalRecord *) flash->data(logAddr(i));
+		if (found->magic != JOURNAL_MAGIC || found->count < 1 || found->count >= journalSlots) continue;
+		if (found->crc != recordCrc(*found)) continue;
+		if (newest == NONE || (int32_t) (found->seq - seq) > 0) {
+			newest = i;
+			seq    = found->seq;
+		}
+	}
+	if (newest == NONE) return true;
+	
+	// The log goes on in the next sector, so partly staged commits after the newest record are erased before reuse.
+	logHead = (newest / 16 + 1) % (journalSlots + 1) * 16;
+	logSeq  = seq + 1;
+	
+	// Bring the sectors up to date if their commit didn't get to mark itself done.
+	memcpy(recordBuf, flash->data(logAddr(newest)), sizeof(recordBuf));
+	if (record->done != 0xffffffff) return true;
+	for (off_t i = 0; i < record->count; i++) {
+		if (record->sectors[i] >= checkedSectors.size() || record->pages[i] >= logPages) {
+			printf("Error: FlashBD journal commits sector %u, which is out of range\n", record->sectors[i]);
+			return false;
+		}
+	}
+	printf("FlashBD: finishing interrupted commit of %u sectors\n", record->count);
+	for (off_t i = 0; i < record->count; i++) {
+		if (!loadImage(*record, i)) return false;
+		beginApply(record->sectors[i]);
+		if (!finishFlush()) return false;
+	}
+	commitRecord = newest;
+	commitState  = FINISHING;
+	return finishFlush();
+}
+
+// Get the write cache slot for a page, creating it if needed.
+// A new slot is filled from flash only if `load` is true.
+// Returns -1 on error.
+int FlashBD::encache(off_t page, bool load) {
+	int slot = findSlot(page);
 	
-	if (iter != writeCache.end()) {
+	if (slot >= 0) {
 		// It is already in the cache.
-		return iter;
+		return slot;
 		
 	} else {
 		// Make a new entry.
-		Page &data = writeCache[page];
-		readPage(page, data);
-		return writeCache.find(page);
+		if (!makeRoom()) return -1;
+		slot = addSlot(page);
+		if (load) readPage(page, pageData(slot));
+		return slot;
 	}
 }
 
-// Erase a sector of flash, preserving data that need be.
-bool FlashBD::erase(off_t sector) {
-	// Evaluate which pages we need to send back into the write cache.
-	for (off_t i = sector * 16; i < sector * 16 + 16; i++) {
-		// Unerased pages not in the write cache shall be preserved.
-		if (!erasedPages[i]) {
-			// Read this into the write cache.
-			auto iter = encache(i);
-			if (iter == writeCache.end()) return false;
+// Write a run of whole sectors directly, bypassing the write cache.
+// All of it is erased with a single call, which uses the 64 KiB block erase for any aligned 64 KiB in it.
+// Offset and length must be multiples of 4096.
+bool FlashBD::writeRun(off_t offset, off_t length, const uint8_t *in) {
+	off_t first = offset / 256;
+	off_t pages = length / 256;
+	bool  needErase = false;
+	
+	// The sector buffer is needed here.
+	if (!finishFlush()) return false;
+	
+	// Cached pages are overwritten anyway; only erase if the new data can't be programmed as-is.
+	// The data may not be word aligned, so it is checked from a copy in the sector buffer.
+	for (off_t i = 0; i < pages; i++) {
+		if (i % 16 == 0) {
+			checkSector((first + i) / 16);
+			if (!needErase) memcpy(sectorBuf.data(), in + i * 256, 4096);
 		}
+		int slot = findSlot(first + i);
+		if (slot >= 0) removeSlot(slot);
+		if (!needErase && !erasedPages[first + i]) needErase = !programmable(first + i, sectorBuf.data() + i % 16 * 256);
 	}
 	
-	// Erase flash now.
-	off_t addr = _base + sector * 4096;
-	uint32_t irqs = save_and_disable_interrupts();
-	flash_range_erase(addr, 4096);
-	restore_interrupts(irqs);
+	if (needErase) {
+		flash->erase(_base + offset, length);
+		_stats.erases += length / 4096;
+	}
 	
-	// Mark affected pages as erased.
-	for (off_t i = sector * 16; i < sector * 16 + 16; i++) {
-		erasedPages[i] = true;
+	// Flash can't be programmed from XIP, so copy the data through RAM a sector at a time.
+	for (off_t i = 0; i < length; i += 4096) {
+		memcpy(sectorBuf.data(), in + i, 4096);
+		flash->program(_base + offset + i, sectorBuf.data(), 4096);
+	}
+	for (off_t i = 0; i < pages; i++) {
+		erasedPages[first + i] = false;
 	}
 	
 	return true;
 }
 
+// Write a range of whole pages through the write cache.
+bool FlashBD::writeCached(off_t page, off_t count, const uint8_t *in) {
+	// Whole pages are overwritten, so they needn't be read from flash first.
+	for (off_t i = 0; i < count; i++) {
+		int slot = encache(page + i, false);
+		if (slot < 0) return false;
+		memcpy((void *) pageData(slot), (const void *) (in + i * 256), 256);
+	}
+	return true;
+}
+
 // Read a specific page of data.
-void FlashBD::readPage(off_t index, Page &out) {
-	off_t addr = index * 256 + _base + XIP_BASE;
-	memcpy((void *) out, (const void *) addr, 256);
+void FlashBD::readPage(off_t index, uint8_t *out) {
+	memcpy((void *) out, (const void *) flashPage(index), 256);
+}
+
+// Get the current contents of a page that isn't in the write cache.
+// Pages of the sector being flushed that aren't written yet are in the sector buffer, the rest are read from flash.
+// Until the sector is erased, all of its pages are in the sector buffer.
+const uint8_t *FlashBD::flashPage(off_t page) const {
+	if (page / 16 == flushing && (flushErase || ((flushPages >> (page % 16)) & 1))) {
+		return sectorBuf.data() + page % 16 * 256;
+	}
+	return flash->data(page * 256 + _base);
 }
 
 // Read a specific page of data from cache first, flash second.
-// Length may not exceed 256.
+// Reads at most up to the end of the page.
 void FlashBD::readCached(off_t page, std::size_t index, uint8_t *out, std::size_t len) {
-	auto iter = writeCache.find(page);
 	if (index >= 256) return;
 	if (index + len > 256) len = 256 - index;
-	if (iter == writeCache.end()) {
+	int slot = findSlot(page);
+	if (slot < 0) {
 		// Not in cache, read from flash.
-		off_t addr = page * 256 + _base + XIP_BASE;
-		memcpy((void *) (index + out), (const void *) (index + addr), len);
+		memcpy((void *) out, (const void *) (index + flashPage(page)), len);
 		
 	} else {
 		// Read from cache.
-		memcpy((void *) (index + out), (const void *) (index + iter->second), len);
+		_stats.cacheHits ++;
+		memcpy((void *) out, (const void *) (index + pageData(slot)), len);
 	}
 }
 
 
 
+#if PICO_ON_DEVICE
 // Create a built-in flash block device from a region of flash.
 // Base and size must be a multiple of the block size.
 // Base must also be a multiple of 4096.
 // Block size must be a power of 2 >= 256.
-FlashBD::FlashBD(off_t blockSize, off_t base, off_t size) {
-	_blockSize = blockSize;
-	_blocks    = size / _blockSize;
-	_base      = base;
-	valid      = true;
-	cacheLimit = 16;
+// Up to `cachePages` pages of 256 bytes are cached before being written to flash.
+// If `journalSectors` (at least 2) is not 0, sectors are only erased through a journal,
+// so power loss can't damage data that wasn't being written; see `beginCommit`.
+// A page being programmed when power is lost may still be left partly written.
+// The journal takes `journalSectors + 1` sectors from the end of the region.
+FlashBD::FlashBD(off_t blockSize, off_t base, off_t size, off_t cachePages, off_t journalSectors):
+	FlashBD(PicoFlash::builtin(), blockSize, base, size, cachePages, journalSectors) {}
+#endif
+
+// Create a flash block device from a region of any flash.
+// The same requirements apply as for the built-in flash.
+FlashBD::FlashBD(FlashBackend &_flash, off_t blockSize, off_t base, off_t size, off_t cachePages, off_t journalSectors) {
+	flash        = &_flash;
+	_blockSize   = blockSize;
+	_base        = base;
+	valid        = true;
+	cacheLimit   = cachePages;
+	journalSlots = journalSectors;
+	
+	// The journal comes off the end.
+	off_t journalSize = journalSlots ? (journalSlots + 1) * 4096 : 0;
+	if (journalSlots > MAX_JOURNAL) {
+		printf("Error: FlashBD journal (%u sectors) larger than %u sectors\n", journalSlots, MAX_JOURNAL);
+		valid = false;
+	} else if (journalSlots == 1) {
+		printf("Error: FlashBD journal needs at least 2 sectors\n");
+		valid = false;
+	} else if (journalSlots && (size % 4096 || size <= journalSize)) {
+		printf("Error: FlashBD size (%u) not aligned to 4096 or too small for the journal\n", size);
+		valid = false;
+	} else {
+		size -= journalSize;
+	}
+	journalBase = _base + size;
+	_blocks     = size / _blockSize;
 	
 	// Check parameters.
 	if (_blockSize < 256 || (_blockSize & (_blockSize - 1))) {
@@ -127,7 +672,7 @@ FlashBD::FlashBD(off_t blockSize, off_t base, off_t size) {
 		valid = false;
 	}
 	if (base % 4096) {
-		printf("Error: FlashBD base (%u) not aligned to 4096\n", size);
+		printf("Error: FlashBD base (%u) not aligned to 4096\n", base);
 		valid = false;
 	} else if (base % _blockSize) {
 		printf("Error: FlashBD base (%u) not aligned to %u\n", base, _blockSize);
@@ -137,13 +682,39 @@ FlashBD::FlashBD(off_t blockSize, off_t base, off_t size) {
 		printf("Error: FlashBD size (%u) not aligned to %u\n", size, _blockSize);
 		valid = false;
 	}
+	if (cacheLimit < 1 || cacheLimit > 16384) {
+		printf("Error: FlashBD cache size (%u) not between 1 and 16384 pages\n", cacheLimit);
+		valid = false;
+	}
 	
 	// Allocate bits for erased status.
 	off_t sectorCount = (size - 1) / 4096 + 1;
 	// There are 16 pages per sector.
 	if (valid) erasedPages.resize(sectorCount * 16);
+	if (valid) checkedSectors.resize(sectorCount);
 	// Calculate pages per block.
 	pagePerBlock = blockSize / 256;
+	if (!valid) return;
+	
+	// Preallocate the write cache, so writing never allocates.
+	slotData.resize(cacheLimit * 256);
+	slotPage.assign(cacheLimit, NONE);
+	freeSlots.resize(cacheLimit);
+	for (off_t i = 0; i < cacheLimit; i++) {
+		freeSlots[i] = cacheLimit - 1 - i;
+	}
+	indexShift = 31;
+	while ((1u << (32 - indexShift)) < cacheLimit * 2) indexShift --;
+	pageIndex.assign(1u << (32 - indexShift), EMPTY);
+	sectorBuf.resize(4096);
+	flushing   = NONE;
+	flushErase = false;
+	flushPages = 0;
+	commitState = IDLE;
+	logHead    = 0;
+	logSeq     = 0;
+	// A commit that can't be finished is left for a later mount rather than written over.
+	if (journalSlots && !recoverJournal()) valid = false;
 }
 
 
@@ -151,6 +722,7 @@ FlashBD::FlashBD(off_t blockSize, off_t base, off_t size) {
 // Read a single block from this device.
 // This function may fail if length != blockSize.
 FileError FlashBD::readBlock(off_t index, uint8_t *out, std::size_t length) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, length);
 	if (!valid) return FileError::DISK_ERROR;
 	
 	// Assert index and length bounds.
@@ -168,23 +740,41 @@ FileError FlashBD::readBlock(off_t index, uint8_t *out, std::size_t length) {
 // Write a single block to this device.
 // This function may fail if length != blockSize.
 FileError FlashBD::writeBlock(off_t index, const uint8_t *in, std::size_t length) {
-	if (!valid) return FileError::DISK_ERROR;
+	StatScope scope(*this, &BlockStats::writes, &BlockStats::bytesWritten, length);
 	if (length % _blockSize) return FileError::INVALID_PARAM;
+	return writeBlocks(index, length / _blockSize, in);
+}
+
+// Read `count` consecutive blocks starting at `first`.
+FileError FlashBD::readBlocks(off_t first, off_t count, uint8_t *out) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, (uint64_t) count * _blockSize);
+	// The single block read already works in pages.
+	return readBlock(first, out, count * _blockSize);
+}
+
+// Write `count` consecutive blocks starting at `first`.
+FileError FlashBD::writeBlocks(off_t first, off_t count, const uint8_t *in) {
+	StatScope scope(*this, &BlockStats::writes, &BlockStats::bytesWritten, (uint64_t) count * _blockSize);
+	if (!valid) return FileError::DISK_ERROR;
 	
 	// Assert index and length bounds.
-	if (index + length / _blockSize > _blocks) return FileError::INVALID_PARAM;
-	
-	// Append to the write cache.
-	off_t page = index * pagePerBlock;
-	for (off_t i = 0; i < pagePerBlock; i++) {
-		// Get or create the write cache entry.
-		Page &data = writeCache[i];
-		// Put in the new data.
-		memcpy((void *) data, (const void *) (in + i * 256), 256);
+	if (first + count > _blocks) return FileError::INVALID_PARAM;
+	
+	// Aligned runs of at least LARGE_ERASE bytes skip the write cache and are erased in one go.
+	off_t start    = first * _blockSize;
+	off_t end      = start + count * _blockSize;
+	off_t runStart = (_base + start + LARGE_ERASE - 1) & ~(LARGE_ERASE - 1);
+	off_t runEnd   = (_base + end) & ~(LARGE_ERASE - 1);
+	if (runEnd <= runStart) {
+		runStart = runEnd = _base + end;
 	}
+	runStart -= _base;
+	runEnd   -= _base;
 	
-	// Make sure the write cache isn't too big.
-	if (!syncExcess()) return FileError::DISK_ERROR;
+	// The parts before and after go through the write cache as usual.
+	if (!writeCached(start / 256, (runStart - start) / 256, in)) return FileError::DISK_ERROR;
+	if (runEnd > runStart && !writeRun(runStart, runEnd - runStart, in + (runStart - start))) return FileError::DISK_ERROR;
+	if (!writeCached(runEnd / 256, (end - runEnd) / 256, in + (runEnd - start))) return FileError::DISK_ERROR;
 	
 	return FileError::OK;
 }
@@ -192,35 +782,83 @@ FileError FlashBD::writeBlock(off_t index, const uint8_t *in, std::size_t length
 // Force any cached writes to be written to the media immediately.
 // You should call this occasionally to prevent data loss and also every time before shutdown.
 FileError FlashBD::sync() {
+	StatScope scope(*this, &BlockStats::syncs);
 	if (!valid) return FileError::DISK_ERROR;
 	
-	// Call sync on all entries in the write cache.
-	while (!writeCache.empty()) {
-		// We keep taking the iterator because `sync(iter)` removes from the map.
-		auto iter = writeCache.begin();
-		if (!sync(iter)) return FileError::DISK_ERROR;
+	// Flush every sector that has cached pages, each at most once.
+	// When journaled, the ones that need erasing are committed in batches.
+	if (!finishFlush()) return FileError::DISK_ERROR;
+	for (off_t page: slotPage) {
+		if (page != NONE && !flushSector(page / 16)) return FileError::DISK_ERROR;
 	}
 	
 	return FileError::OK;
 }
 
 
+// Get a pointer to `count` consecutive blocks starting at `index` through XIP.
+// Fails if any of the blocks have pending writes in the write cache.
+const uint8_t *FlashBD::map(off_t index, off_t count) {
+	if (!valid) return nullptr;
+	if (index + count > _blocks) return nullptr;
+	
+	// Any cached page in the range means flash is out of date.
+	off_t first = index * pagePerBlock;
+	off_t last  = (index + count) * pagePerBlock;
+	for (off_t page: slotPage) {
+		if (page != NONE && page >= first && page < last) return nullptr;
+	}
+	if (flushing != NONE && flushing * 16 + 16 > first && flushing * 16 < last) return nullptr;
+	
+	return flash->data(_base + index * _blockSize);
+}
+
+
+
+// Write part of the write cache to flash, taking about `budget_us` microseconds.
+// Each call does at least one flash operation and starts no more once the budget is used up.
+// It may overrun the budget by at most one sector erase, with interrupts disabled only for single operations.
+// Returns true once the write cache is empty and everything is in flash.
+bool FlashBD::flushSome(uint32_t budget_us) {
+	if (!valid) return false;
+	
+	uint64_t start = flash->micros();
+	do {
+		if (!flushBusy()) {
+			off_t sector = fullestSector();
+			if (sector == NONE) return true;
+			if (!beginFlush(sector)) return false;
+		}
+		// A single page is the smallest amount of work, so the budget is kept as well as possible.
+		if (!flushStep(1)) return false;
+	} while (flash->micros() - start < budget_us);
+	
+	return !flushBusy() && freeSlots.size() == cacheLimit;
+}
+
+// Check all of the flash for blank pages now, instead of when each sector is first written.
+void FlashBD::scanBlank() {
+	for (off_t sector = 0; sector < checkedSectors.size(); sector++) {
+		checkSector(sector);
+	}
+}
+
+
 
 // Read a range of bytes from this block device.
 FileError FlashBD::read(off_t offset, uint8_t *out, std::size_t length) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, length);
 	if (!valid) return FileError::DISK_ERROR;
-	if (offset + length >= _blockSize * _blocks) return FileError::INVALID_PARAM;
-	if (!length) return FileError::OK;
-	
-	// First page in the thing.
-	std::size_t i = 0;
-	off_t    page = offset / 256;
-	readCached(page++, offset % 256, out, length);
-	i += 256 - offset % 256;
-	
-	// Any remaining pages.
-	for (; i < length; i += 256) {
-		readCached(page++, 0, out + i, length - i);
+	if (offset + length > _blockSize * _blocks) return FileError::INVALID_PARAM;
+	
+	// Read page by page, the first one possibly partial.
+	std::size_t i     = 0;
+	std::size_t start = offset % 256;
+	off_t       page  = offset / 256;
+	while (i < length) {
+		readCached(page++, start, out + i, length - i);
+		i    += 256 - start;
+		start = 0;
 	}
 	
 	return FileError::OK;
@@ -228,36 +866,29 @@ FileError FlashBD::read(off_t offset, uint8_t *out, std::size_t length) {
 
 // Write a range of bytes to this block device.
 FileError FlashBD::write(off_t offset, const uint8_t *out, std::size_t length) {
+	StatScope scope(*this, &BlockStats::writes, &BlockStats::bytesWritten, length);
 	if (!valid) return FileError::DISK_ERROR;
-	if (offset + length >= _blockSize * _blocks) return FileError::INVALID_PARAM;
-	
-	// First page in the thing.
-	std::size_t i = 0;
-	off_t    page = offset / 256;
-	auto     iter = encache(page++);
-	if (iter == writeCache.end()) return FileError::DISK_ERROR;
-	
-	// Determine length to copy into page.
-	std::size_t cpy = length < 256 ? length : 256;
-	cpy -= (offset % 256);
-	
-	// Copy into write cache entry.
-	memcpy((void *) (iter->second + offset % 256), (const void *) out, cpy);
-	i += cpy;
-	
-	// Any remaining pages.
-	for (; i < length; i += 256) {
-		iter = encache(page++);
-		if (iter == writeCache.end()) return FileError::DISK_ERROR;
+	if (offset + length > _blockSize * _blocks) return FileError::INVALID_PARAM;
+	
+	// Write page by page, the first and last ones possibly partial.
+	std::size_t i     = 0;
+	std::size_t start = offset % 256;
+	off_t       page  = offset / 256;
+	while (i < length) {
+		// Determine length to copy into page.
+		std::size_t cpy = 256 - start;
+		if (cpy > length - i) cpy = length - i;
+		
+		// Partial pages keep the rest of their data.
+		int slot = encache(page++, cpy < 256);
+		if (slot < 0) return FileError::DISK_ERROR;
 		
 		// Copy into write cache entry.
-		cpy = length - i < 256 ? length - i : 256;
-		memcpy((void *) iter->second, (const void *) (out + i), cpy);
+		memcpy((void *) (pageData(slot) + start), (const void *) (out + i), cpy);
+		i    += cpy;
+		start = 0;
 	}
 	
-	// Make sure the write cache isn't too big.
-	if (!syncExcess()) return FileError::DISK_ERROR;
-	
 	return FileError::OK;
 }
 
@@ -273,7 +904,7 @@ FileError FlashBD::setBlockSize(off_t newSize) {
 		printf("Error: FlashBD new block size (%u) is not a power of 2 >= 256\n", newSize);
 		return FileError::INVALID_PARAM;
 	}
-	if (_base % _blockSize) {
+	if (_base % newSize) {
 		printf("Error: FlashBD base (%u) not aligned to %u\n", _base, newSize);
 		return FileError::INVALID_PARAM;
 	}
@@ -1,20 +1,65 @@
 
+#pragma once
+
 #include "blockdevice.hpp"
-#include "hardware/flash.h"
-#include "hardware/address_mapped.h"
-#include <map>
+#include "flash_backend.hpp"
 #include <vector>
 
 class FlashBD: public BlockDevice {
 	public:
 		// Write cache data type.
 		using Page = uint8_t[256];
-		// Write cache type (page index to page data).
-		using WriteCache = std::map<off_t, Page>;
 		
 	protected:
+		// Marks an unused write cache slot.
+		static constexpr off_t NONE = (off_t) -1;
+		// Marks an empty write cache index entry.
+		static constexpr int16_t EMPTY = -1;
+		// Smallest aligned run of sectors written directly with a single erase.
+		static constexpr off_t LARGE_ERASE = 32768;
+		// Most sectors a journal can have, besides the one the log may need to erase.
+		static constexpr off_t MAX_JOURNAL = 16;
+		// Magic value at the start of a commit record ("FBJ2").
+		static constexpr uint32_t JOURNAL_MAGIC = 0x324a4246;
+		
+		// Commit record, in one page of the journal's log, right after the images it commits.
+		struct JournalRecord {
+			// Must be JOURNAL_MAGIC.
+			uint32_t magic;
+			// Sequence number of the commit; the record with the highest one is the newest.
+			uint32_t seq;
+			// Number of sectors committed.
+			uint32_t count;
+			// CRC of the record, except for this and the done marker.
+			uint32_t crc;
+			// Cleared once all sectors are written to where they belong.
+			uint32_t done;
+			// Sector each image belongs in.
+			uint32_t sectors[MAX_JOURNAL];
+			// Log page each image starts at; the log wraps around within an image.
+			uint32_t pages[MAX_JOURNAL];
+			// CRC of each image.
+			uint32_t sectorCrc[MAX_JOURNAL];
+		};
+		
+		// What the commit in progress is doing.
+		enum CommitState: uint8_t {
+			// There is no commit in progress.
+			IDLE,
+			// Staging the images of the sectors in the log.
+			STAGING,
+			// Writing the commit record.
+			RECORDING,
+			// Writing the sectors to where they belong.
+			APPLYING,
+			// Marking the commit record as done.
+			FINISHING,
+		};
+		
 		// It valid?
 		bool valid;
+		// Flash this is stored in.
+		FlashBackend *flash;
 		// Base address in flash.
 		off_t _base;
 		// Number of pages in a block.
@@ -23,32 +68,160 @@ class FlashBD: public BlockDevice {
 		off_t cacheLimit;
 		
 		// Page erase status vector.
-		// Initially, it is assumed no pages are erased.
+		// Initially, it is assumed no pages are erased, until the sector is checked for blank pages.
 		std::vector<bool> erasedPages;
-		// Write cache.
+		// Sectors whose pages have been checked for being blank.
+		std::vector<bool> checkedSectors;
+		
+		// Write cache page data, `cacheLimit` slots of 256 bytes.
 		// When reading, this is checked first.
-		WriteCache writeCache;
-		// Sync a specific write cache entry.
-		bool sync(WriteCache::iterator entry);
-		// Sync, but only for when the writeCache is too big.
-		bool syncExcess();
-		// Get or copy a page to cache, then return the iterator for the entry.
-		WriteCache::iterator encache(off_t page);
-		// Erase a sector of flash, preserving data that need be.
-		bool erase(off_t sector);
+		std::vector<uint8_t> slotData;
+		// Page held by each write cache slot, or NONE.
+		std::vector<off_t> slotPage;
+		// Stack of unused write cache slots.
+		std::vector<int16_t> freeSlots;
+		// Open-addressed index from page to write cache slot, or EMPTY.
+		// Its size is a power of 2 at least twice `cacheLimit`, so probe sequences stay short.
+		std::vector<int16_t> pageIndex;
+		// Right shift turning a hashed page number into an index position.
+		uint8_t indexShift;
+		// Buffer for one 4096-byte sector while it is erased and rewritten.
+		std::vector<uint8_t> sectorBuf;
+		// Sector being flushed, or NONE.
+		// Its pages that aren't written yet are in the sector buffer, where reads find them.
+		off_t flushing;
+		// Whether the sector being flushed still has to be erased.
+		bool flushErase;
+		// Bitmask of the pages of the sector being flushed that still have to be programmed.
+		uint16_t flushPages;
+		// Number of sectors in the journal, less one, or 0 if not journaled.
+		// A commit takes at most one sector less than this, so the log never erases the newest commit record.
+		off_t journalSlots;
+		// Address of the journal: a log of sector images and commit records, going round through its sectors.
+		off_t journalBase;
+		// Next unused page in the log.
+		// The sector it is in is erased when the log gets to its first page.
+		off_t logHead;
+		// Sequence number of the next commit record.
+		uint32_t logSeq;
+		// What the commit in progress is doing.
+		CommitState commitState;
+		// Entry of the commit record of the sector being staged or applied.
+		off_t commitIndex;
+		// Next page of the sector being staged.
+		off_t commitPage;
+		// CRC of the pages of the sector being staged so far.
+		uint32_t commitCrc;
+		// Log page of the commit record, once it is written.
+		off_t commitRecord;
+		// Commit record of the commit in progress.
+		uint8_t recordBuf[256];
+		
+		// Get the index position a page's probe sequence starts at.
+		std::size_t indexHome(off_t page) const { return (uint32_t) (page * 2654435761u) >> indexShift; }
+		// Find the write cache slot holding a page.
+		// Returns -1 if the page is not cached.
+		int findSlot(off_t page) const;
+		// Take an unused write cache slot for a page and add it to the index.
+		// There must be an unused slot.
+		int addSlot(off_t page);
+		// Remove a write cache slot from the index and mark it unused.
+		void removeSlot(int slot);
+		// Get the data of a write cache slot.
+		uint8_t *pageData(int slot) { return slotData.data() + slot * 256; }
+		
+		// Count the write cache slots holding pages of a sector.
+		int cachedInSector(off_t sector) const;
+		// Check whether a page in flash is blank (all 0xFF), which is as good as erased.
+		bool pageBlank(off_t page) const;
+		// Mark the blank pages in a sector as erased, if the sector hasn't been checked yet.
+		void checkSector(off_t sector);
+		// Check whether a page can be programmed over what is in flash now, i.e. no bit goes from 0 to 1.
+		bool programmable(off_t page, const uint8_t *data) const;
+		// Check whether flushing a sector needs it erased, because a cached page can't be programmed over what is in flash.
+		bool needsErase(off_t sector);
+		// Move all cached pages of a sector into the sector buffer and start flushing it.
+		// The sector is erased once if any of them needs it, otherwise the pages are programmed as-is.
+		// Pages that aren't erased can still be programmed over if no bit goes from 0 to 1.
+		// When journaled, a sector that needs erasing is committed through the journal instead.
+		// No flash is written yet, except to finish the previous flush.
+		bool beginFlush(off_t sector);
+		// Do one step of the current flush, which is one flash operation at most:
+		// erase the sector, program a run of at most `maxPages` pages, or one step of a commit.
+		bool flushStep(off_t maxPages);
+		// Finish the current flush, if any.
+		bool finishFlush();
+		// Check whether a flush or commit is in progress.
+		bool flushBusy() const { return flushing != NONE || commitState != IDLE; }
+		// Write all cached pages of a sector to flash and remove them from the cache.
+		bool flushSector(off_t sector);
+		// Find the sector that gets the most pages written per erase, or NONE if nothing is cached.
+		off_t fullestSector() const;
+		// Make sure there is an unused write cache slot, moving the sector with the most cached pages out if needed.
+		// That sector's flush is only started, so the write that needs room doesn't wait for all of it.
+		bool makeRoom();
+		// Start flushing the image in the sector buffer to a sector, erasing it only if some page can't be programmed over what is there.
+		// Only pages that differ are programmed, so doing this again after being interrupted gives the same result.
+		void beginApply(off_t sector);
+		// Get the CRC of a commit record, which covers everything but the CRC itself and the done marker.
+		static uint32_t recordCrc(const JournalRecord &record);
+		// Get the address of a page of the journal's log.
+		off_t logAddr(off_t page) const { return journalBase + page * 256; }
+		// Erase the log sector the log head is at the start of, unless it is blank.
+		// Returns true if it was erased.
+		bool eraseLog();
+		// Start committing sectors that need erasing through the journal, starting with `sector`.
+		// Other such cached sectors are taken along, sharing the commit record.
+		// The new image of `sector` goes into the sector buffer, the others stay in the write cache until they are staged.
+		// No flash is written yet; `flushStep` stages the images in the log, writes the commit record,
+		// writes the sectors to where they belong and marks the record done, one flash operation at a time.
+		void beginCommit(off_t sector);
+		// Do one step of staging, recording or finishing the commit in progress.
+		bool commitStep(off_t maxPages);
+		// Load the image of a sector of a commit record from the log into the sector buffer.
+		// Fails if it doesn't match its CRC, in which case the commit can't be applied.
+		bool loadImage(const JournalRecord &record, off_t index);
+		// Start applying the next sector of the commit in progress, or finish it once all are written.
+		bool nextApply();
+		// Finish a commit that was interrupted by power loss, and find where the log continues.
+		// Fails if the commit can't be applied.
+		bool recoverJournal();
+		// Get the write cache slot for a page, creating it if needed.
+		// A new slot is filled from flash only if `load` is true.
+		// Returns -1 on error.
+		int encache(off_t page, bool load);
+		// Write a run of whole sectors directly, bypassing the write cache.
+		// All of it is erased with a single call, which uses the 64 KiB block erase for any aligned 64 KiB in it.
+		// Offset and length must be multiples of 4096.
+		bool writeRun(off_t offset, off_t length, const uint8_t *in);
+		// Write a range of whole pages through the write cache.
+		bool writeCached(off_t page, off_t count, const uint8_t *in);
 		// Read a specific page of data from flash.
-		void readPage(off_t page, Page &out);
+		void readPage(off_t page, uint8_t *out);
+		// Get the current contents of a page that isn't in the write cache.
+		// Pages of the sector being flushed that aren't written yet are in the sector buffer, the rest are read from flash.
+		const uint8_t *flashPage(off_t page) const;
 		// Read a specific page of data from cache first, flash second.
-		// Length may not exceed 256.
+		// Reads at most up to the end of the page.
 		void readCached(off_t page, std::size_t index, uint8_t *out, std::size_t len);
 		
 	public:
 		FlashBD(): valid(false) {}
+#if PICO_ON_DEVICE
 		// Create a built-in flash block device from a region of flash.
 		// Base and size must be a multiple of the block size.
 		// Base must also be a multiple of 4096.
 		// Block size must be a power of 2 >= 256.
-		FlashBD(off_t blockSize, off_t base, off_t size);
+		// Up to `cachePages` pages of 256 bytes are cached before being written to flash.
+		// If `journalSectors` (at least 2) is not 0, sectors are only erased through a journal,
+		// so power loss can't damage data that wasn't being written; see `beginCommit`.
+		// A page being programmed when power is lost may still be left partly written.
+		// The journal takes `journalSectors + 1` sectors from the end of the region.
+		FlashBD(off_t blockSize, off_t base, off_t size, off_t cachePages = 16, off_t journalSectors = 0);
+#endif
+		// Create a flash block device from a region of any flash.
+		// The same requirements apply as for the built-in flash.
+		FlashBD(FlashBackend &flash, off_t blockSize, off_t base, off_t size, off_t cachePages = 16, off_t journalSectors = 0);
 		
 		// Read a single block from this device.
 		// This function may fail if length != blockSize.
@@ -56,9 +229,25 @@ class FlashBD: public BlockDevice {
 		// Write a single block to this device.
 		// This function may fail if length != blockSize.
 		FileError writeBlock(off_t index, const uint8_t *in, std::size_t length);
+		// Read `count` consecutive blocks starting at `first`.
+		FileError readBlocks(off_t first, off_t count, uint8_t *out);
+		// Write `count` consecutive blocks starting at `first`.
+		FileError writeBlocks(off_t first, off_t count, const uint8_t *in);
+		using BlockDevice::readBlocks;
+		using BlockDevice::writeBlocks;
 		// Force any cached writes to be written to the media immediately.
 		// You should call this occasionally to prevent data loss and also every time before shutdown.
 		FileError sync();
+		// Write part of the write cache to flash, taking about `budget_us` microseconds.
+		// Each call does at least one flash operation and starts no more once the budget is used up.
+		// It may overrun the budget by at most one sector erase, with interrupts disabled only for single operations.
+		// Returns true once the write cache is empty and everything is in flash.
+		bool flushSome(uint32_t budget_us);
+		// Get a pointer to `count` consecutive blocks starting at `index` through XIP.
+		// Fails if any of the blocks have pending writes in the write cache.
+		const uint8_t *map(off_t index, off_t count);
+		// Check all of the flash for blank pages now, instead of when each sector is first written.
+		void scanBlank();
 		
 		// Read a range of bytes from this block device.
 		FileError read(off_t offset, uint8_t *out, std::size_t length);
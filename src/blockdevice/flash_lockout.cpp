@@ -0,0 +1,186 @@
+
+#include "flash_lockout.hpp"
+#include "bd_clock.hpp"
+
+#if PICO_ON_DEVICE
+#include <pico/multicore.h>
+#include <hardware/irq.h>
+#include <hardware/sync.h>
+#else
+#include <thread>
+#define __not_in_flash_func(func) func
+#define __force_inline inline __attribute__((always_inline))
+#endif
+
+
+
+#if PICO_ON_DEVICE
+// Lockout whose victim is parked by the FIFO interrupt.
+static FlashLockout *fifoLockout;
+
+// Park the victim when the writing core asks through the FIFO.
+// The FIFO is drained and its status cleared through the registers, as the SDK helpers may not be inlined.
+static void __not_in_flash_func(fifoHandler)() {
+	while (sio_hw->fifo_st & SIO_FIFO_ST_VLD_BITS) (void) sio_hw->fifo_rd;
+	sio_hw->fifo_st = 0xff;
+	if (fifoLockout) fifoLockout->park();
+}
+#endif
+
+// Read a word shared between the cores.
+// This and the helpers below are forced inline, as they are called from code in RAM.
+static __force_inline uint32_t load(const uint32_t &word) {
+	return __atomic_load_n(&word, __ATOMIC_SEQ_CST);
+}
+
+// Write a word shared between the cores.
+static __force_inline void store(uint32_t &word, uint32_t value) {
+	__atomic_store_n(&word, value, __ATOMIC_SEQ_CST);
+}
+
+// Disable interrupts on this core, returning the previous state.
+// Interrupt handlers may run from flash, so the victim can't take them while parked.
+static __force_inline uint32_t disableInterrupts() {
+#if PICO_ON_DEVICE
+	return save_and_disable_interrupts();
+#else
+	return 0;
+#endif
+}
+
+// Restore the interrupt state returned by `disableInterrupts`.
+static __force_inline void restoreInterrupts(uint32_t saved) {
+#if PICO_ON_DEVICE
+	restore_interrupts(saved);
+#else
+	(void) saved;
+#endif
+}
+
+// Wait a bit for the writing core to finish, sleeping until it signals on the device.
+static __force_inline void waitForWriter() {
+#if PICO_ON_DEVICE
+	__wfe();
+#else
+	std::this_thread::yield();
+#endif
+}
+
+// Wait a bit for the victim to get off flash.
+static __force_inline void waitForVictim() {
+#if PICO_ON_DEVICE
+	tight_loop_contents();
+#else
+	std::this_thread::yield();
+#endif
+}
+
+// Get the time in microseconds.
+static inline uint64_t micros() {
+	return bdNanos() / 1000;
+}
+
+
+
+// Create a lockout with no victim.
+FlashLockout::FlashLockout():
+	busy(0), state(ABSENT), _stats{}, started(0) {}
+
+// Register the calling core as the victim, running from flash.
+// On the device, a SIO FIFO interrupt handler is installed on this core to park it,
+// so it must not use the inter-core FIFO for anything else.
+void FlashLockout::victimInit() {
+#if PICO_ON_DEVICE
+	uint irq = SIO_IRQ_PROC0 + get_core_num();
+	fifoLockout = this;
+	multicore_fifo_drain();
+	multicore_fifo_clear_irq();
+	irq_set_exclusive_handler(irq, fifoHandler);
+	irq_set_enabled(irq, true);
+#endif
+	// A flash write may already be going on, which didn't wait for an absent victim.
+	resume();
+}
+
+// Unregister the victim; called on the victim's core.
+void FlashLockout::victimExit() {
+#if PICO_ON_DEVICE
+	uint irq = SIO_IRQ_PROC0 + get_core_num();
+	irq_set_enabled(irq, false);
+	irq_remove_handler(irq, fifoHandler);
+	fifoLockout = nullptr;
+#endif
+	store(state, ABSENT);
+}
+
+// Called by the victim before it runs code from RAM, during which flash may be written.
+// Interrupts stay enabled, so any interrupt handler the victim may take until `leaveRam` must be in RAM too.
+// This runs from RAM, as a flash write may start as soon as the state is stored.
+void __not_in_flash_func(FlashLockout::enterRam)() {
+	store(state, IN_RAM);
+}
+
+// Called by the victim when it is done running from RAM, waiting for a flash write in progress to finish.
+void __not_in_flash_func(FlashLockout::leaveRam)() {
+	resume();
+}
+
+// Park the victim until the flash write in progress is done, if it is running from flash.
+// Code running from RAM that gets interrupted is left alone, it is already off flash.
+// Interrupts are disabled while parked, like the SDK's multicore lockout does, as their handlers may be in flash.
+void __not_in_flash_func(FlashLockout::park)() {
+	if (load(state) != RUNNING) return;
+	uint32_t saved = disableInterrupts();
+	store(state, PARKED);
+	resume();
+	restoreInterrupts(saved);
+}
+
+// Wait until no flash write is in progress, then go back to running from flash.
+// The writer sets `busy` before reading `state`, and this sets `state` before reading `busy`,
+// so either the writer sees the victim running and waits, or the victim sees the write and backs off.
+void __not_in_flash_func(FlashLockout::resume)() {
+	for (;;) {
+		while (load(busy)) waitForWriter();
+		store(state, RUNNING);
+		if (!load(busy)) return;
+		store(state, PARKED);
+	}
+}
+
+
+
+// Get the victim off flash before a flash write, waiting for it to park if needed.
+void FlashLockout::begin() {
+	started = micros();
+	store(busy, 1);
+	
+	if (load(state) == RUNNING) {
+		_stats.parks ++;
+#if PICO_ON_DEVICE
+		// One word is enough to raise the interrupt; if the FIFO is full, it already is raised.
+		if (multicore_fifo_wready()) {
+			sio_hw->fifo_wr = 0;
+			__sev();
+		}
+#endif
+		while (load(state) == RUNNING) waitForVictim();
+	}
+	
+	uint32_t wait = micros() - started;
+	_stats.waitMicros += wait;
+	if (wait > _stats.maxWaitMicros) _stats.maxWaitMicros = wait;
+}
+
+// Let the victim use flash again after a flash write.
+void FlashLockout::end() {
+	store(busy, 0);
+#if PICO_ON_DEVICE
+	__sev();
+#endif
+	
+	uint32_t locked = micros() - started;
+	_stats.ops ++;
+	_stats.lockedMicros += locked;
+	if (locked > _stats.maxLockedMicros) _stats.maxLockedMicros = locked;
+}
@@ -0,0 +1,93 @@
+
+#pragma once
+
+#include <stdint.h>
+
+// Keeps the other core off XIP flash while one core erases or programs it, without stopping it for longer than needed.
+// The other core, the victim, registers with `victimInit` and is then either running from flash,
+// running code from RAM that it brackets with `enterRam` and `leaveRam`, or parked in RAM until the flash is free.
+// A victim running from RAM doesn't notice flash writes at all; it only waits if it tries to leave RAM during one.
+// Its interrupts stay enabled meanwhile, so every handler it may take while in RAM must be in RAM as well.
+// A victim running from flash is asked to park, by a FIFO interrupt on the device, or when it calls `checkpoint`,
+// and is parked with its interrupts disabled.
+// Only one core may write flash, and a victim that never registered is assumed not to be running.
+// The protocol only uses sequentially consistent loads and stores, which the compiler always inlines,
+// and the helpers that the parts running from RAM use are forced inline, so they don't call into flash.
+class FlashLockout {
+	public:
+		// What the victim is doing.
+		enum State: uint32_t {
+			// Not registered, so not running anything that matters.
+			ABSENT,
+			// Running from flash; flash can't be written.
+			RUNNING,
+			// Running from RAM.
+			IN_RAM,
+			// Waiting in RAM for a flash write to finish.
+			PARKED,
+		};
+		
+		// Cost of the flash writes done so far.
+		struct Stats {
+			// Number of flash writes.
+			uint32_t ops;
+			// Number of those for which the victim had to be parked.
+			uint32_t parks;
+			// Total time spent waiting for the victim to get off flash, in microseconds.
+			uint64_t waitMicros;
+			// Longest time spent waiting for the victim to get off flash, in microseconds.
+			uint32_t maxWaitMicros;
+			// Total time the victim was locked off flash, in microseconds.
+			uint64_t lockedMicros;
+			// Longest time the victim was locked off flash, in microseconds.
+			uint32_t maxLockedMicros;
+		};
+		
+	protected:
+		// Set while a flash write is in progress or about to start.
+		uint32_t busy;
+		// What the victim is doing, only changed by the victim.
+		uint32_t state;
+		// Cost of the flash writes done so far.
+		Stats _stats;
+		// Time at which the current flash write started.
+		uint64_t started;
+		
+		// Wait until no flash write is in progress, then go back to running from flash.
+		void resume();
+		
+	public:
+		// Create a lockout with no victim.
+		FlashLockout();
+		
+		// Register the calling core as the victim, running from flash.
+		// On the device, a SIO FIFO interrupt handler is installed on this core to park it,
+		// so it must not use the inter-core FIFO for anything else.
+		void victimInit();
+		// Unregister the victim; called on the victim's core.
+		void victimExit();
+		// Called by the victim before it runs code from RAM, during which flash may be written.
+		// Interrupts stay enabled, so any interrupt handler the victim may take until `leaveRam` must be in RAM too.
+		void enterRam();
+		// Called by the victim when it is done running from RAM, waiting for a flash write in progress to finish.
+		void leaveRam();
+		// Called by the victim from flash, parking it if a flash write is waiting for it.
+		void checkpoint() {
+			if (__atomic_load_n(&busy, __ATOMIC_SEQ_CST)) park();
+		}
+		// Park the victim until the flash write in progress is done, if it is running from flash.
+		// Interrupts are disabled while parked, as their handlers may be in flash.
+		void park();
+		
+		// Get the victim off flash before a flash write, waiting for it to park if needed.
+		void begin();
+		// Let the victim use flash again after a flash write.
+		void end();
+		
+		// Get what the victim is doing.
+		State victimState() const { return (State) __atomic_load_n(&state, __ATOMIC_SEQ_CST); }
+		// Get the cost of the flash writes done so far.
+		const Stats &stats() const { return _stats; }
+		// Reset the cost of the flash writes to zero.
+		void resetStats() { _stats = {}; }
+};
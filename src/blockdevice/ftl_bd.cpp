@@ -0,0 +1,423 @@
+
+#include "ftl_bd.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#if PICO_ON_DEVICE
+#include "pico_flash.hpp"
+#endif
+
+
+
+// Get the address of a physical slot to read from.
+const uint8_t *FtlBD::slotAddr(off_t phys) const {
+	off_t sector = phys / slots;
+	off_t slot   = phys % slots;
+	return flash->data(_base + sector * 4096 + (slot + 1) * _blockSize);
+}
+
+// Get the header of a sector to read from.
+const FtlBD::Header *FtlBD::header(off_t sector) const {
+	return (const Header *) flash->data(_base + sector * 4096);
+}
+
+// Check whether a physical slot is still blank.
+bool FtlBD::slotBlank(off_t phys) const {
+	const uint32_t *data = (const uint32_t *) slotAddr(phys);
+	uint32_t all = 0xffffffff;
+	for (off_t i = 0; i < _blockSize / 4; i++) {
+		all &= data[i];
+	}
+	return all == 0xffffffff;
+}
+
+// Get the logical block in a tag, or NONE if it is not written or incomplete.
+FtlBD::off_t FtlBD::tagBlock(uint32_t tag) const {
+	off_t block = tag & 0xffff;
+	if ((tag >> 16) != (~block & 0xffff) || block >= _blocks) return NONE;
+	return block;
+}
+
+
+
+// Erase a sector and give it a fresh header.
+void FtlBD::eraseSector(off_t sector) {
+	// The new header keeps the erase count, but has no sequence number or tags yet.
+	uint8_t buf[256];
+	Header *head = (Header *) buf;
+	memset(buf, 0xff, sizeof(buf));
+	head->magic      = MAGIC;
+	head->eraseCount = ++sectorErases[sector];
+	
+	off_t addr = _base + sector * 4096;
+	flash->erase(addr, 4096);
+	flash->program(addr, buf, 256);
+	_stats.erases ++;
+	
+	if (sectorState[sector] == USED) freeSectors ++;
+	sectorState[sector] = FREE;
+	sectorSeq[sector]   = SEQ_FREE;
+	sectorValid[sector] = 0;
+}
+
+// Start filling the least worn sector that is not in use.
+bool FtlBD::openSector() {
+	// Find the least worn sector.
+	off_t best = NONE;
+	for (off_t i = 0; i < sectors; i++) {
+		if (sectorState[i] == USED) continue;
+		if (best == NONE || sectorErases[i] < sectorErases[best]) best = i;
+	}
+	if (best == NONE) return false;
+	
+	// Sectors of unknown contents are erased first.
+	if (sectorState[best] == DIRTY) eraseSector(best);
+	
+	// Give it a sequence number, so it takes priority over older sectors when mounting.
+	Header *head = (Header *) headerBuf;
+	memcpy(headerBuf, header(best), sizeof(headerBuf));
+	head->seq = nextSeq;
+	
+	off_t addr = _base + best * 4096;
+	flash->program(addr, headerBuf, 256);
+	
+	sectorState[best] = USED;
+	sectorSeq[best]   = nextSeq++;
+	freeSectors --;
+	active = best;
+	fill   = 0;
+	
+	return true;
+}
+
+// Get a free physical slot to write to, starting a new sector if needed.
+// Only garbage collection may use the last sector that is not in use.
+// Other writes fail if it is already used, which can happen after power loss during garbage collection.
+bool FtlBD::takeSlot(bool forCollect, off_t &phys) {
+	bool   open    = active == NONE || fill >= slots;
+	off_t  reserve = forCollect ? 0 : 1;
+	if (freeSectors < reserve + open) return false;
+	if (open && !openSector()) return false;
+	phys = active * slots + fill++;
+	return true;
+}
+
+// Program a block into a free physical slot and map it.
+void FtlBD::program(off_t block, off_t phys, const uint8_t *data) {
+	off_t sector = phys / slots;
+	off_t slot   = phys % slots;
+	off_t addr   = _base + sector * 4096;
+	Header *head = (Header *) headerBuf;
+	
+	// Data first, then the tag that makes it count.
+	head->tags[slot] = block | (~block << 16);
+	flash->program(addr + (slot + 1) * _blockSize, data, _blockSize);
+	flash->program(addr, headerBuf, 256);
+	
+	// The old copy, if any, is now outdated.
+	if (blockMap[block] != NONE) sectorValid[blockMap[block] / slots] --;
+	blockMap[block] = phys;
+	sectorValid[sector] ++;
+}
+
+// Pick the sector to reclaim next, or NONE if there is none worth reclaiming.
+// Usually this is the one with the least valid blocks, but cold data on little worn sectors is moved as well.
+FtlBD::off_t FtlBD::pickVictim(bool wearOnly) const {
+	off_t    fewest  = NONE;
+	off_t    coldest = NONE;
+	uint32_t maxWear = 0;
+	for (off_t i = 0; i < sectors; i++) {
+		if (sectorErases[i] > maxWear) maxWear = sectorErases[i];
+		if (sectorState[i] != USED || i == active) continue;
+		if (fewest == NONE || sectorValid[i] < sectorValid[fewest]) fewest = i;
+		if (coldest == NONE || sectorErases[i] < sectorErases[coldest]) coldest = i;
+	}
+	
+	// Move cold data once the wear gets too uneven, so the little worn sector gets used for hot data.
+	// Only if it fits in the space left with a slot to spare, as power loss while moving it wastes a slot.
+	off_t room = (active == NONE ? 0 : slots - fill) + freeSectors * slots;
+	if (coldest != NONE && maxWear - sectorErases[coldest] > WEAR_LIMIT && sectorValid[coldest] < room) {
+		return coldest;
+	}
+	if (wearOnly) return NONE;
+	
+	// Otherwise, reclaiming is only worth it if there is at least one outdated block.
+	if (fewest == NONE || sectorValid[fewest] >= slots) return NONE;
+	return fewest;
+}
+
+// Move all valid blocks out of a sector and erase it.
+bool FtlBD::reclaim(off_t sector) {
+	const Header *head = header(sector);
+	if (freeSectors == 0 && (active == NONE || sectorValid[sector] > slots - fill)) return compact(sector);
+	
+	for (off_t slot = 0; slot < slots && sectorValid[sector]; slot++) {
+		off_t phys  = sector * slots + slot;
+		off_t block = tagBlock(head->tags[slot]);
+		if (block == NONE || blockMap[block] != phys) continue;
+		
+		// Flash can't be programmed from XIP, so copy the block through RAM.
+		memcpy(moveBuf.data(), slotAddr(phys), _blockSize);
+		off_t to;
+		if (!takeSlot(true, to)) return false;
+		program(block, to, moveBuf.data());
+	}
+	
+	eraseSector(sector);
+	return true;
+}
+
+// Erase a sector and write its valid blocks back into it, keeping them in RAM meanwhile.
+// Only used when there is nowhere else to move them, which power loss during garbage collection can cause.
+// Unlike moving them, this loses the blocks if power fails halfway.
+bool FtlBD::compact(off_t sector) {
+	const Header *head = header(sector);
+	std::vector<off_t>   keep;
+	std::vector<uint8_t> data;
+	for (off_t slot = 0; slot < slots; slot++) {
+		off_t phys  = sector * slots + slot;
+		off_t block = tagBlock(head->tags[slot]);
+		if (block == NONE || blockMap[block] != phys) continue;
+		keep.push_back(block);
+		data.insert(data.end(), slotAddr(phys), slotAddr(phys) + _blockSize);
+	}
+	
+	// The rest of the active sector is given up, this sector becomes the new active one.
+	eraseSector(sector);
+	active = NONE;
+	for (std::size_t i = 0; i < keep.size(); i++) {
+		blockMap[keep[i]] = NONE;
+		off_t to;
+		if (!takeSlot(true, to)) return false;
+		program(keep[i], to, data.data() + i * _blockSize);
+	}
+	
+	return true;
+}
+
+// Rebuild the mapping from the sector headers.
+void FtlBD::mount() {
+	// Find out what state all sectors are in.
+	std::vector<off_t> used;
+	nextSeq     = 0;
+	freeSectors = 0;
+	for (off_t i = 0; i < sectors; i++) {
+		const Header *head = header(i);
+		sectorValid[i] = 0;
+		if (head->magic != MAGIC) {
+			sectorState[i]  = DIRTY;
+			sectorErases[i] = 0;
+			sectorSeq[i]    = SEQ_FREE;
+			freeSectors ++;
+		} else if (head->seq == SEQ_FREE) {
+			sectorState[i]  = FREE;
+			sectorErases[i] = head->eraseCount;
+			sectorSeq[i]    = SEQ_FREE;
+			freeSectors ++;
+		} else {
+			sectorState[i]  = USED;
+			sectorErases[i] = head->eraseCount;
+			sectorSeq[i]    = head->seq;
+			if (head->seq >= nextSeq) nextSeq = head->seq + 1;
+			used.push_back(i);
+		}
+	}
+	
+	// Sectors that lost their header to power loss during an erase are assumed to be as worn as the most worn one.
+	uint32_t maxWear = 0;
+	for (off_t i = 0; i < sectors; i++) {
+		if (sectorErases[i] > maxWear) maxWear = sectorErases[i];
+	}
+	for (off_t i = 0; i < sectors; i++) {
+		if (sectorState[i] == DIRTY) sectorErases[i] = maxWear;
+	}
+	
+	// Replay the used sectors from oldest to newest.
+	for (std::size_t i = 1; i < used.size(); i++) {
+		off_t cur = used[i];
+		std::size_t j = i;
+		for (; j > 0 && sectorSeq[used[j - 1]] > sectorSeq[cur]; j--) used[j] = used[j - 1];
+		used[j] = cur;
+	}
+	for (off_t sector: used) {
+		const Header *head = header(sector);
+		for (off_t slot = 0; slot < slots; slot++) {
+			off_t block = tagBlock(head->tags[slot]);
+			if (block == NONE) continue;
+			if (blockMap[block] != NONE) sectorValid[blockMap[block] / slots] --;
+			blockMap[block] = sector * slots + slot;
+			sectorValid[sector] ++;
+		}
+	}
+	
+	// Continue filling the newest sector after its last used slot.
+	// Slots with data but no tag were interrupted mid-write and are skipped.
+	active = NONE;
+	if (!used.empty()) {
+		active = used.back();
+		fill   = slots;
+		while (fill > 0 && header(active)->tags[fill - 1] == 0xffffffff && slotBlank(active * slots + fill - 1)) fill --;
+		memcpy(headerBuf, header(active), sizeof(headerBuf));
+	}
+}
+
+
+
+#if PICO_ON_DEVICE
+// Create a flash translation layer on a region of the built-in flash.
+// Base and size must be multiples of 4096; `spareSectors` (at least 2) of it are kept free for garbage collection.
+// Block size must be a power of 2 between 256 and 2048.
+FtlBD::FtlBD(off_t base, off_t size, off_t blockSize, off_t spareSectors):
+	FtlBD(PicoFlash::builtin(), base, size, blockSize, spareSectors) {}
+#endif
+
+// Create a flash translation layer on a region of any flash.
+// The same requirements apply as for the built-in flash.
+FtlBD::FtlBD(FlashBackend &_flash, off_t base, off_t size, off_t blockSize, off_t spareSectors) {
+	flash      = &_flash;
+	_blockSize = blockSize;
+	_blocks    = 0;
+	_base      = base;
+	valid      = true;
+	sectors    = size / 4096;
+	slots      = 4096 / blockSize - 1;
+	
+	// Check parameters.
+	if (_blockSize < 256 || _blockSize > 2048 || (_blockSize & (_blockSize - 1))) {
+		printf("Error: FtlBD block size (%u) is not a power of 2 between 256 and 2048\n", _blockSize);
+		valid = false;
+	}
+	if (base % 4096 || size % 4096) {
+		printf("Error: FtlBD region (%u, %u) not aligned to 4096\n", base, size);
+		valid = false;
+	}
+	if (spareSectors < 2 || sectors <= spareSectors) {
+		printf("Error: FtlBD needs more than %u sectors, has %u\n", spareSectors < 2 ? 2 : spareSectors, sectors);
+		valid = false;
+	}
+	if (valid && sectors * slots >= NONE) {
+		printf("Error: FtlBD region (%u) too large for block size %u\n", size, _blockSize);
+		valid = false;
+	}
+	if (!valid) return;
+	
+	// Everything but the spare sectors can be used for data.
+	_blocks = (sectors - spareSectors) * slots;
+	blockMap.assign(_blocks, NONE);
+	sectorState.resize(sectors);
+	sectorErases.resize(sectors);
+	sectorSeq.resize(sectors);
+	sectorValid.resize(sectors);
+	moveBuf.resize(_blockSize);
+	mount();
+}
+
+
+
+// Read a single block from this device.
+// This function may fail if length != blockSize.
+FileError FtlBD::readBlock(off_t index, uint8_t *out, std::size_t length) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, length);
+	if (length % _blockSize) return FileError::INVALID_PARAM;
+	return readBlocks(index, length / _blockSize, out);
+}
+
+// Write a single block to this device.
+// This function may fail if length != blockSize.
+FileError FtlBD::writeBlock(off_t index, const uint8_t *in, std::size_t length) {
+	StatScope scope(*this, &BlockStats::writes, &BlockStats::bytesWritten, length);
+	if (length % _blockSize) return FileError::INVALID_PARAM;
+	return writeBlocks(index, length / _blockSize, in);
+}
+
+// Read `count` consecutive blocks starting at `first`.
+FileError FtlBD::readBlocks(off_t first, off_t count, uint8_t *out) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, (uint64_t) count * _blockSize);
+	if (!valid) return FileError::DISK_ERROR;
+	if (first + count > _blocks) return FileError::INVALID_PARAM;
+	
+	for (off_t i = 0; i < count; i++) {
+		uint16_t phys = blockMap[first + i];
+		if (phys == NONE) {
+			// Never written, so it reads as erased flash.
+			memset(out + i * _blockSize, 0xff, _blockSize);
+		} else {
+			memcpy(out + i * _blockSize, slotAddr(phys), _blockSize);
+		}
+	}
+	
+	return FileError::OK;
+}
+
+// Write `count` consecutive blocks starting at `first`.
+FileError FtlBD::writeBlocks(off_t first, off_t count, const uint8_t *in) {
+	StatScope scope(*this, &BlockStats::writes, &BlockStats::bytesWritten, (uint64_t) count * _blockSize);
+	if (!valid) return FileError::DISK_ERROR;
+	if (first + count > _blocks) return FileError::INVALID_PARAM;
+	
+	for (off_t i = 0; i < count; i++) {
+		// Collect garbage until there is room.
+		off_t phys;
+		while (!takeSlot(false, phys)) {
+			off_t victim = pickVictim(false);
+			if (victim == NONE || !reclaim(victim)) return FileError::OUT_OF_SPACE;
+		}
+		
+		// The data may be mapped through XIP, and flash can't be programmed from XIP, so copy it through RAM.
+		memcpy(moveBuf.data(), in + i * _blockSize, _blockSize);
+		program(first + i, phys, moveBuf.data());
+	}
+	
+	// Keep the wear even.
+	off_t victim = pickVictim(true);
+	if (victim != NONE && !reclaim(victim)) return FileError::DISK_ERROR;
+	
+	return FileError::OK;
+}
+
+// Force any cached writes to be written to the media immediately.
+// Writes are never cached, so this does nothing.
+FileError FtlBD::sync() {
+	StatScope scope(*this, &BlockStats::syncs);
+	return valid ? FileError::OK : FileError::DISK_ERROR;
+}
+
+// Get a pointer to `count` consecutive blocks starting at `index` through XIP.
+// Only works if the blocks happen to be stored consecutively in one sector.
+const uint8_t *FtlBD::map(off_t index, off_t count) {
+	if (!valid || !count) return nullptr;
+	if (index + count > _blocks) return nullptr;
+	
+	uint16_t phys = blockMap[index];
+	if (phys == NONE) return nullptr;
+	if (phys % slots + count > slots) return nullptr;
+	for (off_t i = 1; i < count; i++) {
+		if (blockMap[index + i] != phys + i) return nullptr;
+	}
+	
+	return slotAddr(phys);
+}
+
+
+
+// Attempt to resize the block size.
+// The block size is part of the format, so only the current one is accepted.
+FileError FtlBD::setBlockSize(off_t newSize) {
+	if (!valid) return FileError::DISK_ERROR;
+	if (newSize != _blockSize) {
+		printf("Error: FtlBD block size is fixed at %u\n", _blockSize);
+		return FileError::NOT_SUPPORTED;
+	}
+	return FileError::OK;
+}
+
+
+
+// Reclaim one sector if there is one with outdated blocks in it.
+// Call this when idle, so that writes need to collect garbage less often.
+// Returns true if a sector was reclaimed.
+bool FtlBD::collect() {
+	if (!valid) return false;
+	off_t victim = pickVictim(false);
+	return victim != NONE && reclaim(victim);
+}
@@ -0,0 +1,162 @@
+
+#pragma once
+
+#include "blockdevice.hpp"
+#include "flash_backend.hpp"
+#include <vector>
+
+// Log-structured flash translation layer on a region of the built-in flash.
+// Blocks are never rewritten in place; every write is appended to the current sector and the mapping is kept in RAM.
+// Sectors full of outdated blocks are reclaimed by garbage collection, preferring the least worn free sectors.
+//
+// Each 4096-byte sector holds a header in its first block slot, followed by data slots.
+// The header contains a magic, the sector's erase count, the sequence number of when it was filled and a tag per data slot.
+// A tag is programmed only after its data, so a block is either completely written or not at all.
+// Tags hold the block number twice, once inverted, so a partially programmed tag is recognised and ignored.
+// On mount, the mapping is rebuilt from the tags, with later sectors and later slots taking priority.
+class FtlBD: public BlockDevice {
+	public:
+		// Magic value at the start of every sector header ("FTL1").
+		static constexpr uint32_t MAGIC = 0x314c5446;
+		
+	protected:
+		// Tag/map value for no block.
+		static constexpr uint16_t NONE = 0xffff;
+		// Sequence number of a sector that is erased and not yet filled.
+		static constexpr uint32_t SEQ_FREE = 0xffffffff;
+		// Erase count difference at which cold data is moved to worn sectors.
+		static constexpr uint32_t WEAR_LIMIT = 16;
+		
+		// Sector header, stored in the first page of the sector.
+		struct Header {
+			// Must be MAGIC.
+			uint32_t magic;
+			// Number of times this sector was erased.
+			uint32_t eraseCount;
+			// When this sector started being filled, SEQ_FREE if it is not in use.
+			uint32_t seq;
+			// Logical block in each data slot in the low half and its inverse in the high half.
+			// All ones if not written.
+			uint32_t tags[15];
+		};
+		
+		// State of a sector.
+		enum State: uint8_t {
+			// Contents unknown, must be erased before use.
+			DIRTY,
+			// Erased with a header, ready to be filled.
+			FREE,
+			// Being filled or full.
+			USED,
+		};
+		
+		// It valid?
+		bool valid;
+		// Flash this is stored in.
+		FlashBackend *flash;
+		// Base address in flash.
+		off_t _base;
+		// Number of sectors.
+		off_t sectors;
+		// Number of data slots per sector.
+		off_t slots;
+		
+		// Physical slot of every logical block, NONE if never written.
+		// Physical slot numbers are `sector * slots + slot`.
+		std::vector<uint16_t> blockMap;
+		// State of each sector.
+		std::vector<State> sectorState;
+		// Erase count of each sector.
+		std::vector<uint32_t> sectorErases;
+		// Sequence number of each sector.
+		std::vector<uint32_t> sectorSeq;
+		// Number of data slots in each sector that hold the newest copy of a block.
+		std::vector<uint8_t> sectorValid;
+		// Number of sectors that are not in use.
+		off_t freeSectors;
+		// Sector currently being filled, or NONE.
+		off_t active;
+		// Next unused slot in the active sector.
+		off_t fill;
+		// Sequence number for the next sector to be filled.
+		uint32_t nextSeq;
+		// Copy of the active sector's header, for programming tags.
+		uint8_t headerBuf[256];
+		// Buffer in RAM that blocks are programmed from, as flash can't be programmed from XIP.
+		std::vector<uint8_t> moveBuf;
+		
+		// Get the address of a physical slot to read from.
+		const uint8_t *slotAddr(off_t phys) const;
+		// Get the header of a sector to read from.
+		const Header *header(off_t sector) const;
+		// Check whether a physical slot is still blank.
+		bool slotBlank(off_t phys) const;
+		// Get the logical block in a tag, or NONE if it is not written or incomplete.
+		off_t tagBlock(uint32_t tag) const;
+		
+		// Erase a sector and give it a fresh header.
+		void eraseSector(off_t sector);
+		// Start filling the least worn sector that is not in use.
+		bool openSector();
+		// Get a free physical slot to write to, starting a new sector if needed.
+		// Only garbage collection may use the last sector that is not in use.
+		// Other writes fail if it is already used, which can happen after power loss during garbage collection.
+		bool takeSlot(bool forCollect, off_t &phys);
+		// Program a block into a free physical slot and map it.
+		void program(off_t block, off_t phys, const uint8_t *data);
+		// Pick the sector to reclaim next, or NONE if there is none worth reclaiming.
+		// Usually this is the one with the least valid blocks, but cold data on little worn sectors is moved as well.
+		off_t pickVictim(bool wearOnly) const;
+		// Move all valid blocks out of a sector and erase it.
+		bool reclaim(off_t sector);
+		// Erase a sector and write its valid blocks back into it, keeping them in RAM meanwhile.
+		// Only used when there is nowhere else to move them, which power loss during garbage collection can cause.
+		// Unlike moving them, this loses the blocks if power fails halfway.
+		bool compact(off_t sector);
+		// Rebuild the mapping from the sector headers.
+		void mount();
+		
+	public:
+		FtlBD(): valid(false) {}
+#if PICO_ON_DEVICE
+		// Create a flash translation layer on a region of the built-in flash.
+		// Base and size must be multiples of 4096; `spareSectors` (at least 2) of it are kept free for garbage collection.
+		// Block size must be a power of 2 between 256 and 2048.
+		FtlBD(off_t base, off_t size, off_t blockSize = 512, off_t spareSectors = 2);
+#endif
+		// Create a flash translation layer on a region of any flash.
+		// The same requirements apply as for the built-in flash.
+		FtlBD(FlashBackend &flash, off_t base, off_t size, off_t blockSize = 512, off_t spareSectors = 2);
+		
+		// Read a single block from this device.
+		// This function may fail if length != blockSize.
+		FileError readBlock(off_t index, uint8_t *out, std::size_t length);
+		// Write a single block to this device.
+		// This function may fail if length != blockSize.
+		FileError writeBlock(off_t index, const uint8_t *in, std::size_t length);
+		// Read `count` consecutive blocks starting at `first`.
+		FileError readBlocks(off_t first, off_t count, uint8_t *out);
+		// Write `count` consecutive blocks starting at `first`.
+		FileError writeBlocks(off_t first, off_t count, const uint8_t *in);
+		using BlockDevice::readBlocks;
+		using BlockDevice::writeBlocks;
+		// Force any cached writes to be written to the media immediately.
+		// Writes are never cached, so this does nothing.
+		FileError sync();
+		// Get a pointer to `count` consecutive blocks starting at `index` through XIP.
+		// Only works if the blocks happen to be stored consecutively in one sector.
+		const uint8_t *map(off_t index, off_t count);
+		
+		// Attempt to resize the block size.
+		// The block size is part of the format, so only the current one is accepted.
+		FileError setBlockSize(off_t newSize);
+		
+		// Reclaim one sector if there is one with outdated blocks in it.
+		// Call this when idle, so that writes need to collect garbage less often.
+		// Returns true if a sector was reclaimed.
+		bool collect();
+		// Get the number of sectors.
+		off_t sectorCount() const { return sectors; }
+		// Get the number of times a sector was erased.
+		uint32_t eraseCount(off_t sector) const { return sectorErases[sector]; }
+};
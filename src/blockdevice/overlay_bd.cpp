@@ -0,0 +1,251 @@
+
+#include "overlay_bd.hpp"
+#include <string.h>
+#include "unaligned_access.hpp"
+
+
+
+// Find the slot holding a block, or -1 if not modified.
+int OverlayBD::find(off_t index) const {
+	// Binary search the delta map.
+	std::size_t lo = 0, hi = deltas.size();
+	while (lo < hi) {
+		std::size_t mid = (lo + hi) / 2;
+		if (deltas[mid].index < index) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo < deltas.size() && deltas[lo].index == index) return deltas[lo].slot;
+	return -1;
+}
+
+// Get the slot for a block, adding one if it isn't modified yet.
+// A new slot isn't filled in; it is meant to be overwritten whole.
+// Fails with OUT_OF_SPACE if the overlay is full.
+FileError OverlayBD::acquire(off_t index, off_t &slot) {
+	int found = find(index);
+	if (found >= 0) {
+		slot = found;
+		return FileError::OK;
+	}
+	if (deltas.size() >= capacity) return FileError::OUT_OF_SPACE;
+	
+	// Take the next free slot.
+	slot = slotIndex.size();
+	slotIndex.push_back(index);
+	slotDirty.push_back(true);
+	headerDirty = true;
+	
+	// Insert into the delta map, keeping it sorted.
+	auto iter = deltas.begin();
+	while (iter != deltas.end() && iter->index < index) ++iter;
+	deltas.insert(iter, Delta{index, slot});
+	
+	return FileError::OK;
+}
+
+// Load the modified blocks from the store.
+FileError OverlayBD::load() {
+	uint8_t *header = storage.data() + capacity * _blockSize;
+	FileError ec = store->readBlock(0, header, _blockSize);
+	if (ec) return ec;
+	
+	// A store without header is just empty.
+	if (unaligned_read(*(uint32_t *) header) != MAGIC) return FileError::OK;
+	off_t count = unaligned_read(*(uint32_t *) (header + 4));
+	if (count > capacity) {
+		printf("Error: OverlayBD store holds %u blocks, more than capacity %u\n", count, capacity);
+		return FileError::DISK_ERROR;
+	}
+	
+	// Read the modified blocks.
+	for (off_t i = 0; i < count; i++) {
+		off_t index = unaligned_read(*(uint32_t *) (header + 8 + i * 4));
+		if (index >= _blocks) return FileError::DISK_ERROR;
+		ec = store->readBlock(1 + i, slotData(i), _blockSize);
+		if (ec) return ec;
+		slotIndex.push_back(index);
+		slotDirty.push_back(false);
+	}
+	
+	// Build the delta map.
+	for (off_t i = 0; i < count; i++) {
+		auto iter = deltas.begin();
+		while (iter != deltas.end() && iter->index < slotIndex[i]) ++iter;
+		deltas.insert(iter, Delta{slotIndex[i], i});
+	}
+	
+	return FileError::OK;
+}
+
+// Write the store header.
+FileError OverlayBD::writeHeader() {
+	// The spare block after the slots is used to build the header.
+	uint8_t *header = storage.data() + capacity * _blockSize;
+	memset(header, 0xff, _blockSize);
+	unaligned_write(*(uint32_t *) header, MAGIC);
+	unaligned_write(*(uint32_t *) (header + 4), (uint32_t) slotIndex.size());
+	for (std::size_t i = 0; i < slotIndex.size(); i++) {
+		unaligned_write(*(uint32_t *) (header + 8 + i * 4), (uint32_t) slotIndex[i]);
+	}
+	
+	FileError ec = store->writeBlock(0, header, _blockSize);
+	if (ec) return ec;
+	headerDirty = false;
+	return FileError::OK;
+}
+
+
+
+// Overlay a read-only device with up to `capacity` modified blocks.
+// If `store` is given, modified blocks are loaded from it now and written to it on sync.
+OverlayBD::OverlayBD(std::unique_ptr<BlockDevice> _lower, off_t _capacity, std::unique_ptr<BlockDevice> _store):
+	valid(true), lower(std::move(_lower)), store(std::move(_store)), capacity(_capacity), headerDirty(false) {
+	
+	// Check parameters.
+	if (!lower) {
+		printf("Error: OverlayBD has no lower device\n");
+		valid = false;
+		return;
+	}
+	_blockSize = lower->blockSize();
+	_blocks    = lower->blocks();
+	
+	if (store) {
+		if (store->blockSize() != _blockSize) {
+			printf("Error: OverlayBD store block size (%u) differs from %u\n", store->blockSize(), _blockSize);
+			valid = false;
+			return;
+		}
+		
+		// The store limits the capacity; one header block with room for the indices.
+		off_t maxHeader = (_blockSize - 8) / 4;
+		off_t maxStore  = store->blocks() ? store->blocks() - 1 : 0;
+		if (capacity > maxHeader) capacity = maxHeader;
+		if (capacity > maxStore)  capacity = maxStore;
+	}
+	
+	// Preallocate everything, plus a spare block for the store header.
+	deltas.reserve(capacity);
+	slotIndex.reserve(capacity);
+	slotDirty.reserve(capacity);
+	storage.resize((capacity + 1) * _blockSize);
+	
+	// Pick up where we left off.
+	if (store && load()) {
+		printf("Error: OverlayBD can't load the store\n");
+		valid = false;
+	}
+}
+
+
+
+// Read a single block from this device.
+// This function may fail if length != blockSize.
+FileError OverlayBD::readBlock(off_t index, uint8_t *out, std::size_t length) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, length);
+	if (length % _blockSize) return FileError::INVALID_PARAM;
+	return readBlocks(index, length / _blockSize, out);
+}
+
+// Write a single block to this device.
+// This function may fail if length != blockSize.
+FileError OverlayBD::writeBlock(off_t index, const uint8_t *in, std::size_t length) {
+	StatScope scope(*this, &BlockStats::writes, &BlockStats::bytesWritten, length);
+	if (length % _blockSize) return FileError::INVALID_PARAM;
+	return writeBlocks(index, length / _blockSize, in);
+}
+
+// Read `count` consecutive blocks starting at `first`.
+FileError OverlayBD::readBlocks(off_t first, off_t count, uint8_t *out) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, (uint64_t) count * _blockSize);
+	if (!valid) return FileError::DISK_ERROR;
+	if (first + count > _blocks) return FileError::INVALID_PARAM;
+	
+	// Read the originals in one go.
+	FileError ec = lower->readBlocks(first, count, out);
+	if (ec) return ec;
+	
+	// Then patch in the modified blocks.
+	for (const Delta &delta: deltas) {
+		if (delta.index < first) continue;
+		if (delta.index >= first + count) break;
+		memcpy(out + (delta.index - first) * _blockSize, slotData(delta.slot), _blockSize);
+	}
+	
+	return FileError::OK;
+}
+
+// Write `count` consecutive blocks starting at `first`.
+// Fails with OUT_OF_SPACE if there is no room for more modified blocks.
+FileError OverlayBD::writeBlocks(off_t first, off_t count, const uint8_t *in) {
+	StatScope scope(*this, &BlockStats::writes, &BlockStats::bytesWritten, (uint64_t) count * _blockSize);
+	if (!valid) return FileError::DISK_ERROR;
+	if (first + count > _blocks) return FileError::INVALID_PARAM;
+	
+	// Every block is overwritten whole, so the originals need not be read.
+	for (off_t i = 0; i < count; i++) {
+		off_t slot;
+		FileError ec = acquire(first + i, slot);
+		if (ec) return ec;
+		memcpy(slotData(slot), in + i * _blockSize, _blockSize);
+		slotDirty[slot] = true;
+	}
+	
+	return FileError::OK;
+}
+
+// Write modified blocks to the store, if any.
+FileError OverlayBD::sync() {
+	StatScope scope(*this, &BlockStats::syncs);
+	if (!valid) return FileError::DISK_ERROR;
+	if (!store) return FileError::OK;
+	
+	// Data first, so the header never refers to slots that were not written.
+	// The store may cache writes, so it is synced in between to keep that order on the media.
+	bool wrote = false;
+	for (off_t i = 0; i < slotIndex.size(); i++) {
+		if (!slotDirty[i]) continue;
+		FileError ec = store->writeBlock(1 + i, slotData(i), _blockSize);
+		if (ec) return ec;
+		slotDirty[i] = false;
+		wrote = true;
+	}
+	if (headerDirty) {
+		if (wrote) {
+			FileError ec = store->sync();
+			if (ec) return ec;
+		}
+		FileError ec = writeHeader();
+		if (ec) return ec;
+	}
+	
+	return store->sync();
+}
+
+// Get a pointer to `count` consecutive blocks starting at `index` from the lower device.
+// Fails if any of the blocks are modified.
+const uint8_t *OverlayBD::map(off_t index, off_t count) {
+	if (!valid) return nullptr;
+	
+	for (const Delta &delta: deltas) {
+		if (delta.index >= index + count) break;
+		if (delta.index >= index) return nullptr;
+	}
+	
+	return lower->map(index, count);
+}
+
+// Drop all modifications, going back to the contents of the lower device.
+// This also clears the store.
+FileError OverlayBD::discard() {
+	if (!valid) return FileError::DISK_ERROR;
+	
+	deltas.clear();
+	slotIndex.clear();
+	slotDirty.clear();
+	
+	if (!store) return FileError::OK;
+	FileError ec = writeHeader();
+	if (ec) return ec;
+	return store->sync();
+}
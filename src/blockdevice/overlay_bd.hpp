@@ -0,0 +1,95 @@
+
+#pragma once
+
+#include "blockdevice.hpp"
+#include <memory>
+#include <vector>
+
+// Copy-on-write overlay that makes a read-only block device writable.
+// Modified blocks are kept in RAM, and optionally persisted to a second (e.g. flash) device on sync.
+//
+// The persistent store has the same block size as the overlay and is laid out as:
+//   Block 0:     Header; magic, number of modified blocks, block index of each slot.
+//   Block 1 + n: Data for slot n.
+class OverlayBD: public BlockDevice {
+	protected:
+		// Magic value marking a valid store header ("OVL1").
+		static const uint32_t MAGIC = 0x314c564f;
+		
+		// One entry of the delta map.
+		struct Delta {
+			// Block index on the lower device.
+			off_t index;
+			// Slot holding the modified data.
+			off_t slot;
+		};
+		
+		// It valid?
+		bool valid;
+		// The read-only device underneath.
+		std::unique_ptr<BlockDevice> lower;
+		// Where the modified blocks are persisted, if anywhere.
+		std::unique_ptr<BlockDevice> store;
+		// Maximum number of modified blocks.
+		off_t capacity;
+		// Modified blocks, sorted by block index.
+		std::vector<Delta> deltas;
+		// Block index of each slot in use.
+		std::vector<off_t> slotIndex;
+		// Whether each slot differs from what is in the store.
+		std::vector<bool> slotDirty;
+		// Data of all slots, preallocated at construction.
+		std::vector<uint8_t> storage;
+		// Whether the store header is out of date.
+		bool headerDirty;
+		
+		// Get the data for a slot.
+		uint8_t *slotData(off_t slot) { return storage.data() + slot * _blockSize; }
+		// Find the slot holding a block, or -1 if not modified.
+		int find(off_t index) const;
+		// Get the slot for a block, adding one if it isn't modified yet.
+		// A new slot isn't filled in; it is meant to be overwritten whole.
+		// Fails with OUT_OF_SPACE if the overlay is full.
+		FileError acquire(off_t index, off_t &slot);
+		// Load the modified blocks from the store.
+		FileError load();
+		// Write the store header.
+		FileError writeHeader();
+		
+	public:
+		OverlayBD(): valid(false) {}
+		// Overlay a read-only device with up to `capacity` modified blocks.
+		// If `store` is given, modified blocks are loaded from it now and written to it on sync.
+		OverlayBD(std::unique_ptr<BlockDevice> lower, off_t capacity, std::unique_ptr<BlockDevice> store = nullptr);
+		
+		// Read a single block from this device.
+		// This function may fail if length != blockSize.
+		FileError readBlock(off_t index, uint8_t *out, std::size_t length);
+		// Write a single block to this device.
+		// This function may fail if length != blockSize.
+		FileError writeBlock(off_t index, const uint8_t *in, std::size_t length);
+		// Read `count` consecutive blocks starting at `first`.
+		FileError readBlocks(off_t first, off_t count, uint8_t *out);
+		// Write `count` consecutive blocks starting at `first`.
+		// Fails with OUT_OF_SPACE if there is no room for more modified blocks.
+		FileError writeBlocks(off_t first, off_t count, const uint8_t *in);
+		using BlockDevice::readBlocks;
+		using BlockDevice::writeBlocks;
+		// Write modified blocks to the store, if any.
+		FileError sync();
+		// Get a pointer to `count` consecutive blocks starting at `index` from the lower device.
+		// Fails if any of the blocks are modified.
+		const uint8_t *map(off_t index, off_t count);
+		
+		// Drop all modifications, going back to the contents of the lower device.
+		// This also clears the store.
+		FileError discard();
+		// Get the number of modified blocks.
+		off_t modified() const { return deltas.size(); }
+		// Get the maximum number of modified blocks.
+		off_t maxModified() const { return capacity; }
+		
+		// Attempt to resize the block size.
+		// Not supported, because the modified blocks and store depend on it.
+		FileError setBlockSize(off_t newSize) { return newSize == _blockSize ? FileError::OK : FileError::NOT_SUPPORTED; }
+};
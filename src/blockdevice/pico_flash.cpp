@@ -0,0 +1,44 @@
+
+#include "pico_flash.hpp"
+
+#include <pico/stdlib.h>
+#include <hardware/sync.h>
+#include <hardware/flash.h>
+#include <hardware/address_mapped.h>
+
+
+
+// Get the built-in flash.
+PicoFlash &PicoFlash::builtin() {
+	static PicoFlash flash;
+	return flash;
+}
+
+// Get a pointer to read the flash at `offset` directly.
+const uint8_t *PicoFlash::data(uint32_t offset) {
+	return (const uint8_t *) (XIP_BASE + offset);
+}
+
+// Erase `length` bytes at `offset`, both multiples of 4096.
+void PicoFlash::erase(uint32_t offset, uint32_t length) {
+	_lockout.begin();
+	uint32_t irqs = save_and_disable_interrupts();
+	flash_range_erase(offset, length);
+	restore_interrupts(irqs);
+	_lockout.end();
+}
+
+// Program `length` bytes at `offset`, both multiples of 256.
+// The data may not be in the flash itself.
+void PicoFlash::program(uint32_t offset, const uint8_t *in, uint32_t length) {
+	_lockout.begin();
+	uint32_t irqs = save_and_disable_interrupts();
+	flash_range_program(offset, in, length);
+	restore_interrupts(irqs);
+	_lockout.end();
+}
+
+// Get the time in microseconds since boot.
+uint64_t PicoFlash::micros() {
+	return time_us_64();
+}
@@ -0,0 +1,31 @@
+
+#pragma once
+
+#include "flash_backend.hpp"
+#include "flash_lockout.hpp"
+
+// The RP2040's built-in flash, read through XIP.
+// Interrupts are disabled while erasing or programming, as code can't run from flash meanwhile.
+// The other core is kept off flash by `lockout()`, if it registered as its victim.
+class PicoFlash: public FlashBackend {
+	protected:
+		// Keeps the other core off flash while erasing or programming.
+		FlashLockout _lockout;
+		
+	public:
+		// Get the built-in flash.
+		static PicoFlash &builtin();
+		
+		// Get a pointer to read the flash at `offset` directly.
+		const uint8_t *data(uint32_t offset);
+		// Erase `length` bytes at `offset`, both multiples of 4096.
+		void erase(uint32_t offset, uint32_t length);
+		// Program `length` bytes at `offset`, both multiples of 256.
+		// The data may not be in the flash itself.
+		void program(uint32_t offset, const uint8_t *in, uint32_t length);
+		// Get the time in microseconds since boot.
+		uint64_t micros();
+		
+		// Get the lockout that keeps the other core off flash while erasing or programming.
+		FlashLockout &lockout() { return _lockout; }
+};
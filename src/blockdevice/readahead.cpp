@@ -0,0 +1,105 @@
+
+
+#include "readahead.hpp"
+#include <string.h>
+
+
+
+// Read ahead at most `maxWindow` blocks from `bd`.
+Readahead::Readahead(BlockDevice &bd, BlockDevice::off_t maxWindow):
+	bd(&bd), maxWindow(maxWindow ? maxWindow : 1) {
+	window     = this->maxWindow > 2 ? 2 : this->maxWindow;
+	bufFirst   = 0;
+	bufCount   = 0;
+	bufUsed    = 0;
+	nextOffset = (BlockDevice::off_t) -1;
+}
+
+// Grow or shrink the window depending on how much of the buffer got used.
+void Readahead::adapt() {
+	if (!bufCount) return;
+	
+	if (bufUsed >= bufCount) {
+		// Everything read ahead got used; read further next time.
+		window *= 2;
+		if (window > maxWindow) window = maxWindow;
+	} else if (bufUsed * 2 < bufCount) {
+		// Most of it was wasted; read less next time.
+		window /= 2;
+		if (window < 1) window = 1;
+	}
+}
+
+// Copy whatever part of the start of a read is in the buffer.
+// Returns the number of bytes copied.
+std::size_t Readahead::fromBuffer(BlockDevice::off_t offset, uint8_t *out, std::size_t length) {
+	BlockDevice::off_t blockSize = bd->blockSize();
+	BlockDevice::off_t block     = offset / blockSize;
+	if (!bufCount || block < bufFirst || block >= bufFirst + bufCount) return 0;
+	
+	// Copy up to the end of the buffer.
+	BlockDevice::off_t start = offset - bufFirst * blockSize;
+	std::size_t cpy = bufCount * blockSize - start;
+	if (cpy > length) cpy = length;
+	memcpy(out, buffer.data() + start, cpy);
+	
+	// Keep track of how far into the buffer we got.
+	BlockDevice::off_t used = (start + cpy - 1) / blockSize + 1;
+	if (used > bufUsed) bufUsed = used;
+	
+	return cpy;
+}
+
+
+
+// Read a range of bytes, serving from and refilling the readahead buffer where possible.
+FileError Readahead::read(BlockDevice::off_t offset, uint8_t *out, std::size_t length) {
+	if (!length) return FileError::OK;
+	
+	// Mapped media is already as fast as it gets.
+	const uint8_t *mapped = bd->mapBytes(offset, length);
+	if (mapped) {
+		memcpy(out, mapped, length);
+		return FileError::OK;
+	}
+	
+	// Detect sequential access.
+	bool sequential = offset == nextOffset;
+	nextOffset = offset + length;
+	if (!sequential) {
+		// A seek wastes whatever is left in the buffer.
+		adapt();
+		invalidate();
+	}
+	
+	// Take what we can from the buffer.
+	std::size_t cpy = fromBuffer(offset, out, length);
+	offset += cpy;
+	out    += cpy;
+	length -= cpy;
+	if (!length) return FileError::OK;
+	
+	// Reads that don't look like streaming, or that are larger than the window, go straight to the media.
+	BlockDevice::off_t blockSize = bd->blockSize();
+	if (!sequential || length >= window * blockSize) {
+		return bd->read(offset, out, length);
+	}
+	
+	// Refill the buffer with the next window of blocks.
+	adapt();
+	BlockDevice::off_t first = offset / blockSize;
+	BlockDevice::off_t count = window;
+	if (first + count > bd->blocks()) count = bd->blocks() - first;
+	if (buffer.size() < maxWindow * blockSize) buffer.resize(maxWindow * blockSize);
+	bufFirst = first;
+	bufCount = 0;
+	bufUsed  = 0;
+	FileError ec = bd->readBlocks(first, count, buffer.data());
+	if (ec) return ec;
+	bufCount = count;
+	
+	// The rest of the read should now be in the buffer.
+	cpy = fromBuffer(offset, out, length);
+	if (cpy < length) return bd->read(offset + cpy, out + cpy, length - cpy);
+	return FileError::OK;
+}
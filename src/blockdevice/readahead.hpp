@@ -0,0 +1,44 @@
+
+#pragma once
+
+#include "blockdevice.hpp"
+#include <vector>
+
+// Sequential readahead for one stream of reads from a block device.
+// Each open file should have its own, so access patterns are detected per stream.
+class Readahead {
+	protected:
+		// The block device to read from.
+		BlockDevice *bd;
+		// Maximum number of blocks to read ahead.
+		BlockDevice::off_t maxWindow;
+		// Current number of blocks to read ahead.
+		BlockDevice::off_t window;
+		// Blocks read ahead; allocated on first sequential access to unmapped media.
+		std::vector<uint8_t> buffer;
+		// Block index of the first block in the buffer.
+		BlockDevice::off_t bufFirst;
+		// Number of valid blocks in the buffer.
+		BlockDevice::off_t bufCount;
+		// Number of blocks in the buffer that have been read from.
+		BlockDevice::off_t bufUsed;
+		// Byte offset just after the previous read.
+		BlockDevice::off_t nextOffset;
+		
+		// Grow or shrink the window depending on how much of the buffer got used.
+		void adapt();
+		// Copy whatever part of the start of a read is in the buffer.
+		// Returns the number of bytes copied.
+		std::size_t fromBuffer(BlockDevice::off_t offset, uint8_t *out, std::size_t length);
+		
+	public:
+		// Read ahead at most `maxWindow` blocks from `bd`.
+		Readahead(BlockDevice &bd, BlockDevice::off_t maxWindow = 4);
+		
+		// Read a range of bytes, serving from and refilling the readahead buffer where possible.
+		FileError read(BlockDevice::off_t offset, uint8_t *out, std::size_t length);
+		// Drop the readahead buffer, e.g. after writing to the device.
+		void invalidate() { bufCount = bufUsed = 0; }
+		// Get the current window size in blocks.
+		BlockDevice::off_t windowSize() const { return window; }
+};
@@ -28,6 +28,7 @@ RomBD::RomBD(const uint8_t *data, off_t blockSize, off_t size) {
 // Read a single block from this device.
 // This function may fail if length != blockSize.
 FileError RomBD::readBlock(off_t index, uint8_t *out, std::size_t length) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, length);
 	if (!valid) return FileError::DISK_ERROR;
 	if (index + length / _blockSize > _blocks) return FileError::INVALID_PARAM;
 	
@@ -36,11 +37,33 @@ FileError RomBD::readBlock(off_t index, uint8_t *out, std::size_t length) {
 	return FileError::OK;
 }
 
+// Read `count` consecutive blocks starting at `first`.
+FileError RomBD::readBlocks(off_t first, off_t count, uint8_t *out) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, (uint64_t) count * _blockSize);
+	if (!valid) return FileError::DISK_ERROR;
+	if (first + count > _blocks) return FileError::INVALID_PARAM;
+	
+	// Still just memcpy() it.
+	memcpy((void *) out, (const void *) (data + first * _blockSize), count * _blockSize);
+	return FileError::OK;
+}
+
+
+// Get a pointer to `count` consecutive blocks starting at `index`.
+// The data array is always directly accessible, so this only fails when out of bounds.
+const uint8_t *RomBD::map(off_t index, off_t count) {
+	if (!valid) return nullptr;
+	if (index + count > _blocks) return nullptr;
+	
+	return data + index * _blockSize;
+}
+
 
 // Read a range of bytes from this block device.
 FileError RomBD::read(off_t offset, uint8_t *out, std::size_t length) {
+	StatScope scope(*this, &BlockStats::reads, &BlockStats::bytesRead, length);
 	if (!valid) return FileError::DISK_ERROR;
-	if (offset + length >= _blockSize * _blocks) return FileError::INVALID_PARAM;
+	if (offset + length > _blockSize * _blocks) return FileError::INVALID_PARAM;
 	
 	// Just memcpy() it lol.
 	memcpy((void *) out, (const void *) (data + offset), length);
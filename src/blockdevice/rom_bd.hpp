@@ -1,9 +1,7 @@
 
+#pragma once
+
 #include "blockdevice.hpp"
-#include "hardware/flash.h"
-#include "hardware/address_mapped.h"
-#include <map>
-#include <vector>
 
 class RomBD: public BlockDevice {
 	protected:
@@ -25,9 +23,18 @@ class RomBD: public BlockDevice {
 		// Write a single block to this device.
 		// This function may fail if length != blockSize.
 		FileError writeBlock(off_t index, const uint8_t *in, std::size_t length) { return FileError::NOT_SUPPORTED; }
+		// Read `count` consecutive blocks starting at `first`.
+		FileError readBlocks(off_t first, off_t count, uint8_t *out);
+		// Write `count` consecutive blocks starting at `first`.
+		FileError writeBlocks(off_t first, off_t count, const uint8_t *in) { return FileError::NOT_SUPPORTED; }
+		using BlockDevice::readBlocks;
+		using BlockDevice::writeBlocks;
 		// Force any cached writes to be written to the media immediately.
 		// You should call this occasionally to prevent data loss and also every time before shutdown.
 		FileError sync() { return FileError::OK; }
+		// Get a pointer to `count` consecutive blocks starting at `index`.
+		// The data array is always directly accessible, so this only fails when out of bounds.
+		const uint8_t *map(off_t index, off_t count);
 		
 		// Read a range of bytes from this block device.
 		FileError read(off_t offset, uint8_t *out, std::size_t length);
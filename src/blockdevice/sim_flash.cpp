@@ -0,0 +1,148 @@
+
+#include "sim_flash.hpp"
+#include "bd_clock.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+
+
+// Check the range and alignment of an operation, counting an error if it is wrong.
+bool SimFlash::check(const char *op, uint32_t offset, uint32_t length, uint32_t align) {
+	if (offset % align || length % align || offset > mem.size() || length > mem.size() - offset) {
+		printf("Error: SimFlash %s (%u, %u) out of range or not aligned to %u\n", op, offset, length, align);
+		errors ++;
+		return false;
+	}
+	return true;
+}
+
+// Create `size` bytes of erased flash, a multiple of 4096.
+SimFlash::SimFlash(uint32_t size, Timing _timing):
+	mem(size / 4096 * 4096, 0xff), erases(size / 4096), timing(_timing), busy(0), programs(0), errors(0),
+	ops(0), cutAt(0), tearState(1), tornOffset(0), tornLength(0), tornErase(false) {}
+
+
+
+// Lose power once `count` more erase or program operations are done.
+// The one after is left partly done, and none after that count.
+// How far it gets depends only on `count`, so a cut can be repeated.
+void SimFlash::cutPower(uint64_t count) {
+	cutAt     = ops + count + 1;
+	tearState = count * 2654435761u + 1;
+}
+
+// Get the next pseudo-random byte for tearing an operation.
+uint8_t SimFlash::tearByte() {
+	// Xorshift, which is plenty for picking bits.
+	tearState ^= tearState << 13;
+	tearState ^= tearState >> 17;
+	tearState ^= tearState << 5;
+	return tearState;
+}
+
+// Count an operation, and if power is lost during it, keep what the flash holds with it partly done.
+// That is an erase if `in` is null, otherwise programming it.
+void SimFlash::countOp(uint32_t offset, uint32_t length, const uint8_t *in) {
+	if (++ops != cutAt) return;
+	
+	// The operation goes through its sectors or pages in order, and stops somewhere in one of them.
+	uint32_t unit = in ? 256 : 4096;
+	uint32_t done = (tearByte() | tearByte() << 8) % (length / unit) * unit;
+	cutMem = mem;
+	uint8_t *at = cutMem.data() + offset;
+	tornOffset = offset;
+	tornLength = length;
+	tornErase  = !in;
+	if (!in) {
+		// Erasing sets some bits of the last sector it got to.
+		memset(at, 0xff, done);
+		for (uint32_t i = done; i < done + unit; i++) {
+			at[i] |= tearByte();
+		}
+	} else {
+		// Programming clears some of the bits of the last page it got to.
+		for (uint32_t i = 0; i < done + unit; i++) {
+			at[i] &= i < done ? in[i] : in[i] | tearByte();
+		}
+	}
+}
+
+// Restore power, bringing back what the flash held when it was lost, if it was.
+void SimFlash::restorePower() {
+	if (powerLost()) mem.swap(cutMem);
+	cutMem.clear();
+	cutAt = 0;
+}
+
+
+
+// Get a pointer to read the flash at `offset` directly.
+const uint8_t *SimFlash::data(uint32_t offset) {
+	return mem.data() + offset;
+}
+
+// Erase `length` bytes at `offset`, both multiples of 4096.
+// Aligned 64 KiB blocks are erased at once like the SDK does, the rest one sector at a time.
+void SimFlash::erase(uint32_t offset, uint32_t length) {
+	if (!check("erase", offset, length, 4096)) return;
+	countOp(offset, length, nullptr);
+	
+	memset(mem.data() + offset, 0xff, length);
+	for (uint32_t i = offset; i < offset + length;) {
+		if (i % 65536 == 0 && offset + length - i >= 65536) {
+			busy += timing.blockErase;
+			for (uint32_t j = 0; j < 16; j++) erases[i / 4096 + j] ++;
+			i += 65536;
+		} else {
+			busy += timing.sectorErase;
+			erases[i / 4096] ++;
+			i += 4096;
+		}
+	}
+}
+
+// Program `length` bytes at `offset`, both multiples of 256.
+void SimFlash::program(uint32_t offset, const uint8_t *in, uint32_t length) {
+	if (!check("program", offset, length, 256)) return;
+	countOp(offset, length, in);
+	
+	// Programming can only clear bits.
+	for (uint32_t i = 0; i < length; i++) {
+		mem[offset + i] &= in[i];
+	}
+	programs += length / 256;
+	busy     += length / 256 * timing.pageProgram;
+}
+
+// Get the time in microseconds: the host's monotonic clock plus all time the flash was busy.
+uint64_t SimFlash::micros() {
+	return bdNanos() / 1000 + busy;
+}
+
+
+
+// Put data into the flash as if written by a programmer, without erasing or counting anything.
+void SimFlash::load(uint32_t offset, const uint8_t *in, std::size_t length) {
+	if (offset > mem.size()) return;
+	if (length > mem.size() - offset) length = mem.size() - offset;
+	memcpy(mem.data() + offset, in, length);
+}
+
+// Get the highest erase count of any sector.
+uint32_t SimFlash::maxEraseCount() const {
+	uint32_t max = 0;
+	for (uint32_t count: erases) {
+		if (count > max) max = count;
+	}
+	return max;
+}
+
+// Get the total number of sectors erased.
+uint64_t SimFlash::totalErases() const {
+	uint64_t total = 0;
+	for (uint32_t count: erases) {
+		total += count;
+	}
+	return total;
+}
@@ -0,0 +1,108 @@
+
+#pragma once
+
+#include "flash_backend.hpp"
+#include <cstddef>
+#include <vector>
+
+// NOR flash simulated in memory on a POSIX host, for running the flash block devices off-target.
+// Like real NOR flash, erasing sets bytes to 0xFF and programming ANDs bits into what is there.
+// Every operation is charged a latency, and erases are counted per sector to see the wear.
+// Power can be cut in the middle of an operation, to check what survives it.
+// The flash keeps working after that, so the code using it runs on, but restoring power brings back what it held at the cut.
+class SimFlash: public FlashBackend {
+	public:
+		// Latency of flash operations, in microseconds.
+		struct Timing {
+			// Erasing one 4096-byte sector.
+			uint32_t sectorErase;
+			// Erasing one aligned 64 KiB block.
+			uint32_t blockErase;
+			// Programming one 256-byte page.
+			uint32_t pageProgram;
+		};
+		// Typical timing of the W25Q16JV on the Pico.
+		static constexpr Timing W25Q16 = {45000, 150000, 400};
+		
+	protected:
+		// Contents of the flash.
+		std::vector<uint8_t> mem;
+		// Number of times each sector was erased.
+		std::vector<uint32_t> erases;
+		// Latency of flash operations.
+		Timing timing;
+		// Total time the flash was busy, in microseconds.
+		uint64_t busy;
+		// Number of pages programmed.
+		uint64_t programs;
+		// Number of operations that were out of range or misaligned.
+		uint32_t errors;
+		// Number of erase and program operations started.
+		uint64_t ops;
+		// Operation power is lost during, or 0 if none.
+		uint64_t cutAt;
+		// Contents of the flash when power was lost, with that operation partly done.
+		std::vector<uint8_t> cutMem;
+		// State of the generator for how far the operation power is lost during got.
+		uint32_t tearState;
+		// Offset and length of the operation power was lost during.
+		uint32_t tornOffset, tornLength;
+		// Whether that operation was an erase.
+		bool tornErase;
+		
+		// Count an operation, and if power is lost during it, keep what the flash holds with it partly done.
+		// That is an erase if `in` is null, otherwise programming it.
+		void countOp(uint32_t offset, uint32_t length, const uint8_t *in);
+		// Get the next pseudo-random byte for tearing an operation.
+		uint8_t tearByte();
+		
+		// Check the range and alignment of an operation, counting an error if it is wrong.
+		bool check(const char *op, uint32_t offset, uint32_t length, uint32_t align);
+		
+	public:
+		// Create `size` bytes of erased flash, a multiple of 4096.
+		SimFlash(uint32_t size, Timing timing = W25Q16);
+		
+		// Get a pointer to read the flash at `offset` directly.
+		const uint8_t *data(uint32_t offset);
+		// Erase `length` bytes at `offset`, both multiples of 4096.
+		// Aligned 64 KiB blocks are erased at once like the SDK does, the rest one sector at a time.
+		void erase(uint32_t offset, uint32_t length);
+		// Program `length` bytes at `offset`, both multiples of 256.
+		void program(uint32_t offset, const uint8_t *in, uint32_t length);
+		// Get the time in microseconds: the host's monotonic clock plus all time the flash was busy.
+		uint64_t micros();
+		
+		// Put data into the flash as if written by a programmer, without erasing or counting anything.
+		void load(uint32_t offset, const uint8_t *in, std::size_t length);
+		// Get the size of the flash in bytes.
+		uint32_t size() const { return mem.size(); }
+		// Get the number of times a sector was erased.
+		uint32_t eraseCount(uint32_t sector) const { return erases[sector]; }
+		// Get the highest erase count of any sector.
+		uint32_t maxEraseCount() const;
+		// Get the total number of sectors erased.
+		uint64_t totalErases() const;
+		// Get the number of pages programmed.
+		uint64_t pagePrograms() const { return programs; }
+		// Get the total time the flash was busy, in microseconds.
+		uint64_t busyMicros() const { return busy; }
+		// Get the number of operations that were out of range or misaligned.
+		uint32_t errorCount() const { return errors; }
+		
+		// Lose power once `count` more erase or program operations are done.
+		// The one after is left partly done, and none after that count.
+		// How far it gets depends only on `count`, so a cut can be repeated.
+		void cutPower(uint64_t count);
+		// Restore power, bringing back what the flash held when it was lost, if it was.
+		void restorePower();
+		// Check whether power was lost.
+		bool powerLost() const { return cutAt && ops >= cutAt; }
+		// Get the number of erase and program operations started so far.
+		uint64_t operations() const { return ops; }
+		// Get the offset and length of the operation power was lost during.
+		uint32_t tornOpOffset() const { return tornOffset; }
+		uint32_t tornOpLength() const { return tornLength; }
+		// Check whether the operation power was lost during was an erase.
+		bool tornOpErase() const { return tornErase; }
+};
@@ -21,6 +21,17 @@ static std::string cwd = "/home/user";
 
 
 
+// Forget about a FileDesc after its FILE * was closed.
+static void forgetWrapper(FileDesc *desc) {
+	for (auto iter = fileWrappers.begin(); iter != fileWrappers.end(); ++iter) {
+		if (iter->get() == desc) {
+			fileWrappers.erase(iter);
+			break;
+		}
+	}
+}
+
+#ifdef _NEWLIB_VERSION
 // Wrapper for FileDesc::read.
 static int read_wrapper(struct _reent *reent, void *cookie, char *out, int len) {
 	FileError ec = FileError::OK;
@@ -61,17 +72,64 @@ static int close_wrapper(struct _reent *reent, void *cookie) {
 	int res = desc->close(ec);
 	
 	// Erase it from the list.
-	for (auto iter = fileWrappers.begin(); iter != fileWrappers.end(); ++iter) {
-		if (iter->get() == desc) {
-			fileWrappers.erase(iter);
-			break;
-		}
-	}
+	forgetWrapper(desc);
+	
+	// Return the earlier result.
+	if (res) errno = (int) ec;
+	return res;
+}
+
+#else
+// Wrapper for FileDesc::read, glibc `fopencookie` style.
+static ssize_t read_wrapper(void *cookie, char *out, size_t len) {
+	FileError ec = FileError::OK;
+	// Get the FileDesc object.
+	auto desc = (FileDesc *) cookie;
+	// Forward the function call.
+	int res = desc->read(ec, out, len);
+	if (ec) { errno = (int) ec; return -1; }
+	return res;
+}
+
+// Wrapper for FileDesc::write, glibc `fopencookie` style.
+static ssize_t write_wrapper(void *cookie, const char *in, size_t len) {
+	FileError ec = FileError::OK;
+	// Get the FileDesc object.
+	auto desc = (FileDesc *) cookie;
+	// Forward the function call.
+	int res = desc->write(ec, in, len);
+	if (ec) { errno = (int) ec; return -1; }
+	return res;
+}
+
+// Wrapper for FileDesc::seek, glibc `fopencookie` style.
+static int seek_wrapper(void *cookie, off64_t *off, int whence) {
+	FileError ec = FileError::OK;
+	// Get the FileDesc object.
+	auto desc = (FileDesc *) cookie;
+	// Forward the function call.
+	int res = desc->seek(ec, *off, whence);
+	if (res < 0) { errno = (int) ec; return -1; }
+	*off = res;
+	return 0;
+}
+
+// Wrapper for FileDesc::close, glibc `fopencookie` style.
+static int close_wrapper(void *cookie) {
+	FileError ec = FileError::OK;
+	// Get the FileDesc object.
+	auto desc = (FileDesc *) cookie;
+	// Call its close first.
+	int res = desc->close(ec);
+	
+	// Erase it from the list.
+	forgetWrapper(desc);
 	
 	// Return the earlier result.
 	if (res) errno = (int) ec;
 	return res;
 }
+#endif
 
 
 
@@ -280,6 +338,7 @@ bool isValidFilename(char in) {
 // A call to `fclose()` will call `close()` on the FileDesc.
 FILE *createFD(std::shared_ptr<FileDesc> from) {
 	if (!from.get()) return NULL;
+#ifdef _NEWLIB_VERSION
 	FILE *out = new FILE;
 	
 	// Take ownership of the file object.
@@ -319,6 +378,18 @@ FILE *createFD(std::shared_ptr<FileDesc> from) {
 	out->_flags2 = 0;
 	
 	return out;
+#else
+	// Let glibc build the FILE around the FileDesc.
+	const char *mode = from->isReadWrite() ? "r+" : from->isWrite() ? "w" : "r";
+	cookie_io_functions_t funcs = { read_wrapper, write_wrapper, seek_wrapper, close_wrapper };
+	FILE *out = fopencookie(from.get(), mode, funcs);
+	if (!out) return NULL;
+	
+	// Take ownership of the file object.
+	fileWrappers.push_back(from);
+	
+	return out;
+#endif
 }
 
 // Set the filesystem to use for fopen, remove, etc.
@@ -328,6 +399,9 @@ void setFS(std::shared_ptr<Filesystem> from) {
 
 
 
+#ifdef _NEWLIB_VERSION
+// The following replace the newlib stubs on the device.
+
 // Provide an implementation of pathconf.
 long pathconf(const char *_path, int name) {
 	switch (name) {
@@ -378,9 +452,11 @@ int chdir(const char *path) {
 	cwd = absolutePath(path);
 	return 0;
 }
+#endif
 
 
 
+#ifdef _NEWLIB_VERSION
 // Dumps some info about a file descriptor.
 extern "C" void dumpinfo(FILE *fd) {
 	if (!fd) return;
@@ -404,3 +480,4 @@ extern "C" void dumpinfo(FILE *fd) {
 	printf("  _blksize = %d,\n", fd->_blksize);
 	printf("  _offset = %d,\n", fd->_offset);
 }
+#endif
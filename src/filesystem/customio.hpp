@@ -7,6 +7,11 @@
 #include <memory>
 #include <vector>
 
+#ifndef _NEWLIB_VERSION
+// Newlib's file position type, which the FileDesc API is built around.
+typedef long _fpos_t;
+#endif
+
 
 
 enum FileError {
@@ -79,7 +84,8 @@ class FileDesc {
 		FileDesc(OpenMode mode):
 			allowRead(mode.read),
 			allowWrite(mode.append || mode.write),
-			binary(mode.binary) {}
+			binary(mode.binary),
+			open(true) {}
 		
 	public:
 		// I intend to VIRTUALISE this class.
@@ -269,5 +275,7 @@ FILE *createFD(std::shared_ptr<FileDesc> from);
 // Set the filesystem to use for fopen, remove, etc.
 void setFS(std::shared_ptr<Filesystem> from);
 
+#ifdef _NEWLIB_VERSION
 // Dumps some info about a file descriptor.
 extern "C" void dumpinfo(FILE *fd);
+#endif
@@ -1,5 +1,40 @@
 
 #include "devfs.hpp"
+#include <inttypes.h>
+
+// Render the I/O statistics of all block devices as text.
+std::string DevFS::blockStats() {
+	std::string out = "device         reads   writes    syncs  bytes read  bytes written   erases cache hits      time us\n";
+	char line[128];
+	for (auto &ent: blockDevs) {
+		const BlockStats &st = ent.bd->ioStats();
+		snprintf(line, sizeof(line), "%-12s %7" PRIu32 " %8" PRIu32 " %8" PRIu32 " %11" PRIu64 " %14" PRIu64 " %8" PRIu32 " %10" PRIu32 " %12" PRIu64 "\n",
+			ent.name.c_str(), st.reads, st.writes, st.syncs, st.bytesRead, st.bytesWritten, st.erases, st.cacheHits, st.nanos / 1000);
+		out += line;
+	}
+	return out;
+}
+
+// Show a block device's statistics in `/dev/blkstat`.
+// The block device must stay alive until removed or until this DevFS is destroyed.
+void DevFS::addBlockDevice(const std::string &name, BlockDevice *bd) {
+	blockDevs.push_back(BlockDevEntry{name, bd});
+}
+
+// Stop showing a block device's statistics.
+// Returns true if the block device was present.
+bool DevFS::removeBlockDevice(BlockDevice *bd) {
+	for (auto iter = blockDevs.begin(); iter != blockDevs.end(); iter++) {
+		if (iter->bd == bd) {
+			blockDevs.erase(iter);
+			return true;
+		}
+	}
+	return false;
+}
+
+
+
 
 // List the files in a directory.
 // The given path should already be in absolute form.
@@ -12,7 +47,8 @@ std::vector<DirEnt> DevFS::list(FileError &ec, const Path &path) {
 	
 	// Else!
 	return std::vector<DirEnt>{
-		DirEnt{"null", 0, 0, {1, 1, 0}, {1, 1, 0}, {1, 1, 0}, false, 0, 0}
+		DirEnt{"null", 0, 0, {1, 1, 0}, {1, 1, 0}, {1, 1, 0}, false, 0, 0},
+		DirEnt{"blkstat", 0, 0, {1, 0, 0}, {1, 0, 0}, {1, 0, 0}, false, 0, 0}
 	};
 }
 
@@ -21,6 +57,13 @@ std::vector<DirEnt> DevFS::list(FileError &ec, const Path &path) {
 std::shared_ptr<FileDesc> DevFS::open(FileError &ec, const Path &path, OpenMode mode) {
 	if (path == "/null") {
 		return std::make_shared<NullFile>();
+	} else if (path == "/blkstat") {
+		// Statistics are a snapshot from when the file is opened.
+		if (mode.write || mode.append) {
+			ec = FileError::READ_ONLY;
+			return nullptr;
+		}
+		return std::make_shared<TextFile>(blockStats(), mode);
 	} else {
 		ec = FileError::NOT_FOUND;
 		return nullptr;
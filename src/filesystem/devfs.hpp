@@ -2,6 +2,8 @@
 #pragma once
 
 #include "customio.hpp"
+#include "blockdevice.hpp"
+#include <string.h>
 
 class NullFile: public FileDesc {
 	public:
@@ -31,8 +33,85 @@ class NullFile: public FileDesc {
 		long tell() { return 0; }
 };
 
+class TextFile: public FileDesc {
+	protected:
+		// Contents of the file.
+		std::string text;
+		// Current position in the file.
+		std::size_t pos;
+		
+	public:
+		// Create a read-only file with fixed contents.
+		TextFile(std::string _text, OpenMode mode = Open::R):
+			FileDesc(mode), text(std::move(_text)), pos(0) {}
+		
+		// Read bytes from this file.
+		// Returns read length.
+		int read(FileError &ec, char *out, int len) {
+			if (len < 0) len = 0;
+			if ((std::size_t) len > text.size() - pos) len = text.size() - pos;
+			memcpy(out, text.data() + pos, len);
+			pos += len;
+			return len;
+		}
+		
+		// Write bytes to this file.
+		// Returns written length.
+		int write(FileError &ec, const char *in, int len) {
+			ec = FileError::READ_ONLY;
+			return -1;
+		}
+		
+		// Seeks in the file.
+		// Returns new position on success, -1 on error.
+		int seek(FileError &ec, _fpos_t off, int whence) {
+			switch (whence) {
+				case SEEK_SET: break;
+				case SEEK_CUR: off += pos; break;
+				case SEEK_END: off += text.size(); break;
+				default: ec = FileError::INVALID_PARAM; return -1;
+			}
+			if (off < 0 || (std::size_t) off > text.size()) {
+				ec = FileError::INVALID_PARAM;
+				return -1;
+			}
+			pos = off;
+			return pos;
+		}
+		
+		// Closes the file.
+		// Returns 0 on success, -1 on error.
+		int close(FileError &ec) { open = false; return 0; }
+		
+		// Gets the absolute position in the file.
+		long tell() { return pos; }
+};
+
+// Named block device whose statistics are shown in `/dev/blkstat`.
+struct BlockDevEntry {
+	// Name shown in the statistics.
+	std::string name;
+	// The block device itself.
+	BlockDevice *bd;
+};
+
 class DevFS: public Filesystem {
+	protected:
+		// Block devices shown in `/dev/blkstat`.
+		std::vector<BlockDevEntry> blockDevs;
+		
+		// Render the I/O statistics of all block devices as text.
+		std::string blockStats();
+		
 	public:
+		// Show a block device's statistics in `/dev/blkstat`.
+		// The block device must stay alive until removed or until this DevFS is destroyed.
+		void addBlockDevice(const std::string &name, BlockDevice *bd);
+		// Stop showing a block device's statistics.
+		// Returns true if the block device was present.
+		bool removeBlockDevice(BlockDevice *bd);
+		
+
 		// List the files in a directory.
 		// The given path should already be in absolute form.
 		std::vector<DirEnt> list(FileError &ec, const Path &path);
@@ -7,7 +7,6 @@
 #ifdef DEBUG
 #define debugf printf
 #include "util.h"
-#include "pico/stdlib.h"
 #else
 #define debugf(...) do{}while(0)
 #define hexdump(...) do{}while(0)
@@ -18,6 +17,18 @@ namespace Fat {
 
 
 
+// Read bytes from the media, straight from memory if the media is memory-mapped.
+static FileError mediaRead(BlockDevice &bd, off_t offset, void *out, std::size_t len) {
+	const uint8_t *mapped = bd.mapBytes(offset, len);
+	if (mapped) {
+		memcpy(out, mapped, len);
+		return FileError::OK;
+	}
+	return bd.read(offset, (uint8_t *) out, len);
+}
+
+
+
 // Convert a name string to 8.3 format in an 11-char array.
 void packName(std::string in, char out[11]) {
 	// Start by blanking the output with space (0x20).
@@ -207,27 +218,148 @@ FatDirEnt::FatDirEnt(const RawDirEnt &raw, const std::vector<LongNameEnt> &longN
 
 // Create a FAT.
 FAT::FAT(BlockDevice &bd, off_t index, off_t size, Type type, bool cached):
-	bd(bd), blockIndex(index), size(size), type(type), dirty(false) {
-	
-	// The next part doesn't apply if caching is off.
-	if (!cached) return;
+	bd(bd), blockIndex(index), size(size), type(type), dirty(false), useCounter(0) {
 	
 	// Determine amount of bytes to read.
 	std::size_t read;
 	if (type == Type::FAT12) {
-		read = size * 3 / 2;
+		read = (size * 3 + 1) / 2;
 	} else if (type == Type::FAT16) {
 		read = size * 2;
 	} else /* type == Type::FAT32 */ {
 		read = size * 4;
 	}
+	sectors = (read + bd.blockSize() - 1) / bd.blockSize();
+	
+	// The next part doesn't apply if caching is off.
+	if (!cached) return;
+	
+	if (read > FULL_CACHE_MAX) {
+		// Memory-mapped media is read in place, without a window.
+		if (bd.mapBytes(blockIndex * bd.blockSize(), read)) return;
+		
+		// Too big to keep in RAM, so it is accessed through a window.
+		slots.assign(WINDOW_SLOTS, Slot{NONE, 0, false});
+		window.resize(WINDOW_SLOTS * bd.blockSize());
+		return;
+	}
 	
 	// Read it into a cache.
+	cache.resize(read);
 	bd.read(blockIndex * bd.blockSize(), (uint8_t *) cache.data(), read);
 }
 
 
-// Read an entry from the FAT.
+// Find the window slot holding a FAT sector, or -1 if it isn't in the window.
+int FAT::findSlot(off_t sector) {
+	for (std::size_t i = 0; i < slots.size(); i++) {
+		if (slots[i].sector == sector) return i;
+	}
+	return -1;
+}
+
+// Take the least recently used window slot other than `keep`, writing it back if dirty.
+// Returns -1 on error.
+int FAT::evict(FileError &ec, int keep) {
+	int victim = -1;
+	for (std::size_t i = 0; i < slots.size(); i++) {
+		if ((int) i == keep) continue;
+		if (victim < 0 || slots[i].lastUse < slots[victim].lastUse) victim = i;
+	}
+	
+	writeBack(ec, victim);
+	if (ec) return -1;
+	slots[victim].sector = NONE;
+	return victim;
+}
+
+// Get the window slot for a FAT sector, loading it if needed.
+// On a miss, the sector after it is loaded into the window too, ready for walking a chain onwards.
+// Returns -1 on error.
+int FAT::loadSlot(FileError &ec, off_t sector) {
+	int slot = findSlot(sector);
+	if (slot >= 0) {
+		slots[slot].lastUse = ++ useCounter;
+		return slot;
+	}
+	
+	slot = evict(ec, -1);
+	if (slot < 0) return -1;
+	
+	// Both sectors are read with one request if the next isn't in the window yet.
+	int next = -1;
+	if (sector + 1 < sectors && findSlot(sector + 1) < 0) {
+		next = evict(ec, slot);
+		if (next < 0) return -1;
+	}
+	if (next >= 0) {
+		BlockIOVec iov[2] = {{slotData(slot), bd.blockSize()}, {slotData(next), bd.blockSize()}};
+		ec = bd.readBlocks(blockIndex + sector, 2, iov, 2);
+	} else {
+		ec = bd.readBlock(blockIndex + sector, slotData(slot), bd.blockSize());
+	}
+	if (ec) return -1;
+	
+	// The next sector counts as used just before this one, so it goes first if it isn't needed.
+	slots[slot] = Slot{sector, ++ useCounter, false};
+	if (next >= 0) slots[next] = Slot{sector + 1, useCounter - 1, false};
+	return slot;
+}
+
+// Write a window slot back to the media if dirty.
+void FAT::writeBack(FileError &ec, std::size_t slot) {
+	if (!slots[slot].dirty) return;
+	ec = bd.writeBlock(blockIndex + slots[slot].sector, slotData(slot), bd.blockSize());
+	if (!ec) slots[slot].dirty = false;
+}
+
+// Read bytes of this FAT, through the window if there is one.
+void FAT::readBytes(FileError &ec, off_t offset, void *out, std::size_t len) {
+	if (slots.empty()) {
+		ec = mediaRead(bd, blockIndex * bd.blockSize() + offset, out, len);
+		return;
+	}
+	
+	// FAT12 entries may straddle two sectors.
+	uint8_t *ptr = (uint8_t *) out;
+	while (len) {
+		off_t sector = offset / bd.blockSize();
+		off_t inSector = offset % bd.blockSize();
+		std::size_t part = bd.blockSize() - inSector;
+		if (part > len) part = len;
+		
+		int slot = loadSlot(ec, sector);
+		if (slot < 0) return;
+		memcpy(ptr, slotData(slot) + inSector, part);
+		ptr += part; offset += part; len -= part;
+	}
+}
+
+// Write bytes of this FAT, through the window if there is one.
+void FAT::writeBytes(FileError &ec, off_t offset, const void *in, std::size_t len) {
+	if (slots.empty()) {
+		ec = bd.write(blockIndex * bd.blockSize() + offset, (const uint8_t *) in, len);
+		return;
+	}
+	
+	// FAT12 entries may straddle two sectors.
+	const uint8_t *ptr = (const uint8_t *) in;
+	while (len) {
+		off_t sector = offset / bd.blockSize();
+		off_t inSector = offset % bd.blockSize();
+		std::size_t part = bd.blockSize() - inSector;
+		if (part > len) part = len;
+		
+		int slot = loadSlot(ec, sector);
+		if (slot < 0) return;
+		memcpy(slotData(slot) + inSector, ptr, part);
+		slots[slot].dirty = true;
+		ptr += part; offset += part; len -= part;
+	}
+}
+
+
+// Read an entry from the FAT, without the reserved top 4 bits of FAT32 entries.
 uint32_t FAT::read(FileError &ec, off_t index) {
 	if (cache.size()) {
 		// Cached read.
@@ -249,49 +381,50 @@ uint32_t FAT::read(FileError &ec, off_t index) {
 			return ((uint16_t *) cache.data())[index];
 			
 		} else /* type == Type::FAT32 */ {
-			// Simple read.
-			return ((uint32_t *) cache.data())[index];
+			// Simple read; the top 4 bits are reserved.
+			return ((uint32_t *) cache.data())[index] & 0x0FFFFFFF;
 		}
 		
 	} else {
-		// Direct read.
+		// Direct or windowed read.
 		
 		if (type == Type::FAT12) {
 			// Get 3-byte offset for the thing.
-			off_t offset = blockIndex * bd.blockSize() + index * 3 / 2;
+			off_t offset = index * 3 / 2;
 			
 			// Complex reading shenanigans.
 			uint16_t data;
-			ec = bd.read(offset, (uint8_t *) &data, 2);
+			readBytes(ec, offset, &data, 2);
 			if (ec) return Clusters::DEFECTIVE;
+			data = unaligned_read(data);
 			
 			// Merge the appropriate bits.
 			if (index & 1) {
-				return data >> 4;;
+				return data >> 4;
 			} else {
 				return data & 0x0fff;
 			}
 			
 		} else if (type == Type::FAT16) {
 			// Simple read.
-			off_t offset = blockIndex * bd.blockSize() + index * 2;
+			off_t offset = index * 2;
 			uint16_t data;
-			ec = bd.read(offset, (uint8_t *) &data, 2);
+			readBytes(ec, offset, &data, 2);
 			if (ec) return Clusters::DEFECTIVE;
-			return data;
+			return unaligned_read(data);
 			
 		} else /* type == Type::FAT32 */ {
 			// Simple read.
-			off_t offset = blockIndex * bd.blockSize() + index * 4;
-			uint16_t data;
-			ec = bd.read(offset, (uint8_t *) &data, 4);
+			off_t offset = index * 4;
+			uint32_t data;
+			readBytes(ec, offset, &data, 4);
 			if (ec) return Clusters::DEFECTIVE;
-			return data;
+			return unaligned_read(data) & 0x0FFFFFFF;
 		}
 	}
 }
 
-// Write an entry to the FAT.
+// Write an entry to the FAT, keeping the reserved top 4 bits of FAT32 entries.
 void FAT::write(FileError &ec, off_t index, uint32_t value) {
 	if (cache.size()) {
 		// Cached write.
@@ -318,20 +451,21 @@ void FAT::write(FileError &ec, off_t index, uint32_t value) {
 			
 		} else /* type == Type::FAT32 */ {
 			// Simple write.
-			((uint32_t *) cache.data())[index] = value;
+			uint32_t &entry = ((uint32_t *) cache.data())[index];
+			entry = (entry & 0xF0000000) | (value & 0x0FFFFFFF);
 		}
 		dirty = true;
 		
 	} else {
-		// Direct write.
+		// Direct or windowed write.
 		
 		if (type == Type::FAT12) {
 			// Get 3-byte offset for the thing.
-			off_t offset = blockIndex * bd.blockSize() + index * 3 / 2;
+			off_t offset = index * 3 / 2;
 			
 			// We always need to read before write.
 			uint16_t data;
-			ec = bd.read(offset, (uint8_t *) &data, 2);
+			readBytes(ec, offset, &data, 2);
 			if (ec) return;
 			
 			// Merge the appropriate bits.
@@ -342,30 +476,41 @@ void FAT::write(FileError &ec, off_t index, uint32_t value) {
 			}
 			
 			// Write it back.
-			ec = bd.write(offset, (uint8_t *) &data, 2);
+			writeBytes(ec, offset, &data, 2);
 			
 		} else if (type == Type::FAT16) {
 			// Direct write API.
-			off_t offset = blockIndex * bd.blockSize() + index * 2;
+			off_t offset = index * 2;
 			uint16_t data = value;
-			ec = bd.write(offset, (uint8_t *) &data, sizeof(uint16_t));
+			writeBytes(ec, offset, &data, sizeof(uint16_t));
 			
 		} else /* type == Type::FAT32 */ {
-			// Direct write API.
-			off_t offset = blockIndex * bd.blockSize() + index * 4;
-			uint32_t data = value;
-			ec = bd.write(offset, (uint8_t *) &data, sizeof(uint32_t));
+			// Read before write, for the reserved bits.
+			off_t offset = index * 4;
+			uint32_t data;
+			readBytes(ec, offset, &data, sizeof(uint32_t));
+			if (ec) return;
+			data = unaligned_read(data);
+			
+			// Write it back.
+			unaligned_write(data, (data & 0xF0000000) | (value & 0x0FFFFFFF));
+			writeBytes(ec, offset, &data, sizeof(uint32_t));
 		}
 	}
 }
 
 // Save this to disk if cached.
 void FAT::sync(FileError &ec) {
+	for (std::size_t i = 0; i < slots.size(); i++) {
+		writeBack(ec, i);
+		if (ec) return;
+	}
+	
 	if (dirty) {
 		// Determine amount of bytes to write.
 		std::size_t write;
 		if (type == Type::FAT12) {
-			write = size * 3 / 2;
+			write = (size * 3 + 1) / 2;
 		} else if (type == Type::FAT16) {
 			write = size * 2;
 		} else /* type == Type::FAT32 */ {
@@ -373,34 +518,108 @@ void FAT::sync(FileError &ec) {
 		}
 		
 		ec = bd.write(blockIndex * bd.blockSize(), (uint8_t *) cache.data(), write);
+		if (!ec) dirty = false;
 	}
 }
 
 
 
-// Seek to the next cluster.
-bool Stream::nextCluster(FileError &ec) {
-	// Look it up in the FAT.
-	uint32_t next = fs.fats[fs.activeFat].read(ec, cluster);
-	if (ec) return false;
+// Find the extent holding the cluster at `index` in the file, or -1 if it is past the known extents.
+int Stream::findExtent(off_t index) {
+	const Extent &last = extents.back();
+	if (index >= last.index + last.length) return -1;
 	
-	// If it is EOF then there is corruption.
-	if (next >= Clusters::END_OF_FILE) {
-		ec = FileError::DISK_ERROR;
-		return false;
+	// Find the last extent starting at or before `index`.
+	std::size_t lo = 0, hi = extents.size();
+	while (hi - lo > 1) {
+		std::size_t mid = (lo + hi) / 2;
+		if (extents[mid].index <= index) lo = mid;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// Make the cluster at `index` in the file the current cluster.
+// Known extents are binary searched; further clusters are looked up in the FAT and added to them.
+bool Stream::seekCluster(FileError &ec, off_t index) {
+	if (index == clusterIndex) return true;
+	
+	int found = findExtent(index);
+	if (found >= 0) {
+		cluster      = extents[found].cluster + index - extents[found].index;
+		clusterIndex = index;
+		return true;
+	}
+	
+	// Walk the FAT from the furthest cluster known.
+	const Extent &last = extents.back();
+	off_t cur      = last.cluster + last.length - 1;
+	off_t curIndex = last.index + last.length - 1;
+	if (clusterIndex > curIndex && clusterIndex < index) {
+		cur      = cluster;
+		curIndex = clusterIndex;
+	}
+	while (curIndex < index) {
+		// Look it up in the FAT.
+		uint32_t next = fs.fats[fs.activeFat].read(ec, cur);
+		if (ec) return false;
+		
+		// If it is EOF or not a cluster then there is corruption.
+		// FAT12 and FAT16 markers are smaller than the FAT32 ones, but all of them lie past the last cluster.
+		if (next < Clusters::USED_BEGIN || next >= fs.clusters + 2) {
+			ec = FileError::DISK_ERROR;
+			return false;
+		}
+		cur = next;
+		curIndex ++;
+		
+		// Add it to the extents, unless they ran out before here.
+		Extent &end = extents.back();
+		if (curIndex != end.index + end.length) continue;
+		if (cur == end.cluster + end.length) {
+			end.length ++;
+		} else if (extents.size() < MAX_EXTENTS) {
+			extents.push_back(Extent{curIndex, cur, 1});
+		}
 	}
 	
-	// Otherwise, update current cluster with it.
-	cluster = next;
+	cluster      = cur;
+	clusterIndex = curIndex;
 	return true;
 }
 
+// Count the clusters from the current one up to the one at `lastIndex` that follow each other on disk.
+// The last extent is extended from the FAT as needed; errors only cut the run short.
+off_t Stream::runLength(off_t lastIndex) {
+	int found = findExtent(clusterIndex);
+	if (found < 0) return 1;
+	
+	// Only the last extent can still grow, one cluster at a time.
+	while ((std::size_t) found == extents.size() - 1) {
+		off_t end = extents[found].index + extents[found].length;
+		if (end > lastIndex) break;
+		
+		// Looking up the next cluster adds it to the extents, without moving from the current one.
+		FileError ec = FileError::OK;
+		off_t curCluster = cluster, curIndex = clusterIndex;
+		bool ok = seekCluster(ec, end);
+		cluster      = curCluster;
+		clusterIndex = curIndex;
+		if (!ok || extents[found].index + extents[found].length == end) break;
+	}
+	
+	off_t run = extents[found].index + extents[found].length - clusterIndex;
+	if (run > lastIndex - clusterIndex + 1) run = lastIndex - clusterIndex + 1;
+	return run;
+}
+
 
 // Constructs a stream.
 Stream::Stream(OpenMode mode, FatFS &fs, off_t cluster, off_t size):
 	FileDesc(mode),
-	fs(fs), bd(*fs.media), baseCluster(cluster), cluster(cluster), size(size) {
+	fs(fs), bd(*fs.media), baseCluster(cluster), cluster(cluster), clusterIndex(0), size(size), ahead(*fs.media) {
 	pos = 0;
+	extents.push_back(Extent{0, cluster, 1});
 }
 
 
@@ -411,6 +630,9 @@ int Stream::read(FileError &ec, char *out, int len) {
 	
 	int read = 0;
 	while (pos < size && read < len) {
+		// Find the cluster to read from.
+		if (!seekCluster(ec, pos / fs.clusterSize)) return read;
+		
 		// Compute reading offset.
 		// Subtract 2 from cluster accounts for the offset added by the design.
 		off_t offset = fs.dataSectorIndex * bd.blockSize()
@@ -418,20 +640,21 @@ int Stream::read(FileError &ec, char *out, int len) {
 					+ pos % fs.clusterSize;
 		
 		// Compute reading length.
-		off_t leftInClus = fs.clusterSize - pos % fs.clusterSize;
-		if (leftInClus > len - read) leftInClus = len - read;
+		off_t want = len - read;
+		if (want > size - pos) want = size - pos;
+		
+		// Clusters that follow each other on disk are read in one go.
+		// Large reads go past the readahead, with whole blocks read straight into `out`.
+		off_t run = runLength((pos + want - 1) / fs.clusterSize);
+		off_t leftInRun = run * fs.clusterSize - pos % fs.clusterSize;
+		if (leftInRun > want) leftInRun = want;
 		
 		// Read from the media.
-		ec = bd.read(offset, (uint8_t *) out, leftInClus);
+		ec = ahead.read(offset, (uint8_t *) out, leftInRun);
 		if (ec) return read;
-		out  += leftInClus;
-		read += leftInClus;
-		pos  += leftInClus;
-		
-		// Test whether we need to load the next cluster.
-		if (pos % fs.clusterSize == 0) {
-			if (!nextCluster(ec)) return read;
-		}
+		out  += leftInRun;
+		read += leftInRun;
+		pos  += leftInRun;
 	}
 	
 	return read;
@@ -459,23 +682,8 @@ int Stream::seek(FileError &ec, _fpos_t off, int whence) {
 	// Clamp target position to size.
 	if (target > size) target = size;
 	
-	// Amount of clusters passed in the file.
-	off_t targetClus  = target / fs.clusterSize;
-	off_t currentClus = pos / fs.clusterSize;
-	
-	// If target < current cluster, reset position.
-	if (targetClus < currentClus) {
-		currentClus = 0;
-		cluster = baseCluster;
-	}
-	
-	// If target > current cluster, seek forward.
-	while (targetClus > currentClus) {
-		if (!nextCluster(ec)) return -1;
-		currentClus ++;
-	}
-	
 	// Update byte position.
+	// The cluster is only looked up when reading, from the extents if it was seen before.
 	pos = target;
 	return pos;
 }
@@ -497,7 +705,7 @@ long Stream::tell() {
 // Constructs a stream.
 RootStream::RootStream(OpenMode mode, FatFS &fs, off_t sector, off_t size):
 	FileDesc(mode),
-	fs(fs), bd(*fs.media), sector(sector), size(size) {
+	fs(fs), bd(*fs.media), sector(sector), size(size), ahead(*fs.media) {
 	pos = 0;
 }
 
@@ -510,7 +718,7 @@ int RootStream::read(FileError &ec, char *out, int len) {
 	if (len + pos > size) len = size - pos;
 	
 	// Do a simple read.
-	ec = bd.read(offset, (uint8_t *) out, len);
+	ec = ahead.read(offset, (uint8_t *) out, len);
 	if (ec) return 0;
 	pos += len;
 	
@@ -525,6 +733,7 @@ int RootStream::write(FileError &ec, const char *in, int len) {
 	if (len + pos > size) { ec = FileError::OUT_OF_SPACE; return 0; }
 	
 	// Do a simple write.
+	ahead.invalidate();
 	ec = bd.write(offset, (const uint8_t *) in, len);
 	if (ec) return 0;
 	pos += len;
@@ -577,8 +786,8 @@ void FatFS::interpretBPBCommon(std::vector<uint8_t> &cache, BPBCommon *common, B
 	
 	// Number of sectors occupied by the root directory.
 	rootDirSize    = unaligned_read(common->rootEntCnt);
-	rootDirSectors = (rootDirSize * sizeof(RawDirEnt) - 1)
-				/ unaligned_read(common->bytsPerSec) + 1;
+	rootDirSectors = (rootDirSize * sizeof(RawDirEnt) + unaligned_read(common->bytsPerSec) - 1)
+				/ unaligned_read(common->bytsPerSec);
 	debugf("Root dir sectors: %u\n", rootDirSectors);
 	
 	
@@ -633,6 +842,9 @@ void FatFS::interpretBPB16(std::vector<uint8_t> &cache, BPBCommon *common, BPB16
 	
 	// Get root directory index.
 	rootSectorIndex = fatSectorIndex + fatSectors * numFats;
+	
+	// There is no FSInfo.
+	fsInfoSector    = 0;
 }
 
 // Interpret FAT32 BPB.
@@ -657,6 +869,55 @@ void FatFS::interpretBPB32(std::vector<uint8_t> &cache, BPBCommon *common, BPB32
 	
 	// Get first fat index.
 	fatSectorIndex  = unaligned_read(common->rsvdSecCnt);
+	
+	// Get FSInfo index.
+	fsInfoSector    = unaligned_read(bpb32->FSInfo);
+}
+
+// Read the free cluster hints from the FSInfo sector, if there is a valid one.
+void FatFS::readFSInfo() {
+	fsInfoFree = FSINFO_UNKNOWN;
+	fsInfoNext = FSINFO_UNKNOWN;
+	
+	// It must be in the reserved sectors.
+	if (!fsInfoSector || fsInfoSector >= fatSectorIndex) return;
+	
+	FSInfo info;
+	FileError ec = mediaRead(*media, fsInfoSector * media->blockSize(), &info, sizeof(info));
+	if (ec || info.leadSig != 0x41615252 || info.strucSig != 0x61417272 || info.trailSig != 0xAA550000) {
+		debugf("FSInfo missing or corrupt.\n");
+		return;
+	}
+	
+	// Hints that are out of range are as good as unknown.
+	if (info.freeCount <= clusters) fsInfoFree = info.freeCount;
+	if (info.nxtFree >= 2 && info.nxtFree < clusters + 2) fsInfoNext = info.nxtFree;
+	if (fsInfoFree != FSINFO_UNKNOWN) debugf("FSInfo free:      %u\n", fsInfoFree);
+	if (fsInfoNext != FSINFO_UNKNOWN) debugf("FSInfo next free: %u\n", fsInfoNext);
+}
+
+// Write the free cluster hints to the FSInfo sector, if there is a valid one.
+void FatFS::writeFSInfo(FileError &ec) {
+	if (!fsInfoSector || fsInfoSector >= fatSectorIndex) {
+		fsInfoDirty = false;
+		return;
+	}
+	
+	// Only an FSInfo that was valid is updated.
+	FSInfo info;
+	ec = mediaRead(*media, fsInfoSector * media->blockSize(), &info, sizeof(info));
+	if (ec) return;
+	if (info.leadSig != 0x41615252 || info.strucSig != 0x61417272 || info.trailSig != 0xAA550000) {
+		fsInfoDirty = false;
+		return;
+	}
+	
+	fsInfoFree     = validClusters - usedClusters;
+	fsInfoNext     = allocNext;
+	info.freeCount = fsInfoFree;
+	info.nxtFree   = fsInfoNext;
+	ec = media->write(fsInfoSector * media->blockSize(), (const uint8_t *) &info, sizeof(info));
+	if (!ec) fsInfoDirty = false;
 }
 
 
@@ -831,36 +1092,21 @@ FatFS::FatFS(std::unique_ptr<BlockDevice> _media, bool _writable):
 	
 	
 	// Set up FAT handles.
+	// Cluster indices start at 2, so there are two more entries than clusters.
 	for (uint8_t i = 0; i < numFats; i++) {
 		fats.push_back(FAT(
-			*media, fatSectorIndex + i, clusters, type, i == activeFat
+			*media, fatSectorIndex + i * fatSectors, clusters + 2, type, i == activeFat
 		));
 	}
 	
 	debugf("Data sect index:  %u\n", dataSectorIndex);
 	debugf("Root dir index:   %u\n", rootSectorIndex);
 	
-	// Determine usage statistics.
-	usedClusters  = 0;
-	validClusters = clusters;
-	for (off_t i = 0; i < clusters; i++) {
-		// Checks an entry.
-		uint32_t entry = fats[activeFat].read(ec, i);
-		if (ec) {
-			printf("Input/Output error\n");
-			valid = false; return;
-		}
-		if (entry && entry <= Clusters::USED_END) usedClusters ++;
-		if (entry && entry == Clusters::END_OF_FILE) usedClusters ++;
-		if (entry == Clusters::DEFECTIVE) validClusters --;
-	}
-	debugf("Clusters used:    %03d%% (%u / %u)\n",
-		usedClusters * 100 / validClusters, usedClusters, validClusters
-	);
-	debugf("Clusters broken:  %03d%% (%u / %u)\n",
-		100 - validClusters * 100 / clusters, clusters-validClusters, clusters
-	);
-	
+	// Usage statistics are only determined when asked for, as that reads the whole FAT.
+	clustersCounted = false;
+	readFSInfo();
+	fsInfoDirty = false;
+	allocNext   = fsInfoNext != FSINFO_UNKNOWN ? fsInfoNext : 2;
 }
 
 
@@ -929,9 +1175,210 @@ bool FatFS::remove(FileError &ec, const Path &path) {
 
 // Force any cached writes to be written to the media immediately.
 // You should call this occasionally to prevent data loss and also every time before shutdown.
+// The free cluster hints in FSInfo are updated too.
 bool FatFS::sync(FileError &ec) {
-	ec = FileError::READ_ONLY;
-	return false;
+	if (!writable) {
+		ec = FileError::READ_ONLY;
+		return false;
+	}
+	
+	for (FAT &fat: fats) {
+		fat.sync(ec);
+		if (ec) return false;
+	}
+	if (fsInfoDirty) {
+		writeFSInfo(ec);
+		if (ec) return false;
+	}
+	ec = media->sync();
+	return !ec;
+}
+
+
+// Count the used and defective clusters by scanning the FAT.
+// This is only done once, and not at mount, as it reads the whole FAT.
+bool FatFS::countClusters(FileError &ec) {
+	if (clustersCounted) return true;
+	
+	// The entry that marks a defective cluster.
+	uint32_t defective;
+	if (type == Type::FAT12) defective = Clusters::fat32_to_fat12(Clusters::DEFECTIVE);
+	else if (type == Type::FAT16) defective = Clusters::fat32_to_fat16(Clusters::DEFECTIVE);
+	else defective = Clusters::DEFECTIVE;
+	
+	// Writable mounts also get the cluster map, to allocate from.
+	if (writable) clusterMap.assign((clusters + 31) / 32, 0);
+	
+	// Cluster indices start at 2.
+	off_t used = 0, good = clusters;
+	for (off_t i = 2; i < clusters + 2; i++) {
+		uint32_t entry = fats[activeFat].read(ec, i);
+		if (ec) return false;
+		if (entry == defective) good --;
+		else if (entry != Clusters::FREE) used ++;
+		if (writable && entry != Clusters::FREE) markCluster(i, true);
+	}
+	usedClusters    = used;
+	validClusters   = good;
+	clustersCounted = true;
+	
+	debugf("Clusters used:    %03d%% (%u / %u)\n",
+		usedClusters * 100 / validClusters, usedClusters, validClusters
+	);
+	debugf("Clusters broken:  %03d%% (%u / %u)\n",
+		100 - validClusters * 100 / clusters, clusters-validClusters, clusters
+	);
+	return true;
+}
+
+// Get the number of free clusters.
+// The FSInfo count is used if there is one, otherwise the clusters are counted.
+off_t FatFS::freeClusters(FileError &ec) {
+	if (!clustersCounted && fsInfoFree != FSINFO_UNKNOWN) return fsInfoFree;
+	if (!countClusters(ec)) return 0;
+	return validClusters - usedClusters;
+}
+
+
+// Mark a cluster as used or free in the cluster map.
+void FatFS::markCluster(off_t cluster, bool used) {
+	uint32_t bit = 1u << ((cluster - 2) % 32);
+	if (used) clusterMap[(cluster - 2) / 32] |= bit;
+	else clusterMap[(cluster - 2) / 32] &= ~bit;
+}
+
+// Find the first run of `count` free clusters, searching from cluster `from` on and wrapping around.
+// If there is none, the longest shorter run is found instead.
+// Returns the first cluster of the run and its length in `length`, or 0 if no cluster is free.
+off_t FatFS::findFree(off_t from, off_t count, off_t &length) {
+	off_t bestFirst = 0;
+	length = 0;
+	
+	// Runs don't wrap around the end of the volume.
+	off_t cur = from;
+	for (off_t scanned = 0; scanned < clusters;) {
+		if (cur >= clusters + 2) cur = 2;
+		
+		// Whole words of used clusters are skipped at once.
+		if ((cur - 2) % 32 == 0 && cur + 32 <= clusters + 2 && clusterMap[(cur - 2) / 32] == 0xFFFFFFFF) {
+			cur     += 32;
+			scanned += 32;
+			continue;
+		}
+		if (clusterUsed(cur)) {
+			cur ++;
+			scanned ++;
+			continue;
+		}
+		
+		// Measure the free run here.
+		off_t run = 0;
+		while (run < count && cur + run < clusters + 2 && !clusterUsed(cur + run)) run ++;
+		if (run > length) {
+			bestFirst = cur;
+			length    = run;
+		}
+		if (run >= count) break;
+		cur     += run;
+		scanned += run;
+	}
+	
+	return bestFirst;
+}
+
+// Write an entry to all FATs that are kept in sync.
+void FatFS::writeEntry(FileError &ec, off_t index, uint32_t value) {
+	for (std::size_t i = 0; i < fats.size(); i++) {
+		if (i != activeFat && !fatSync) continue;
+		fats[i].write(ec, index, value);
+		if (ec) return;
+	}
+}
+
+// Save the FATs that entries are written to, then sync the media,
+// so that nothing written afterwards reaches the media before them.
+void FatFS::syncEntries(FileError &ec) {
+	for (std::size_t i = 0; i < fats.size(); i++) {
+		if (i != activeFat && !fatSync) continue;
+		fats[i].sync(ec);
+		if (ec) return;
+	}
+	ec = media->sync();
+}
+
+// Allocate up to `count` clusters as one chain, linked after cluster `after` if it isn't 0.
+// The chain continues right after `after` if possible, so files stay in one piece;
+// otherwise it goes in the first free run long enough, searching on from the previous allocation.
+// Returns the first cluster and sets `allocated` to the number of clusters, or returns 0 on error.
+off_t FatFS::allocate(FileError &ec, off_t count, off_t after, off_t &allocated) {
+	allocated = 0;
+	if (!writable) {
+		ec = FileError::READ_ONLY;
+		return 0;
+	}
+	if (!count || (after && (after < 2 || after >= clusters + 2))) {
+		ec = FileError::INVALID_PARAM;
+		return 0;
+	}
+	if (!countClusters(ec)) return 0;
+	
+	// Extend the file in place if the cluster after its last one is free.
+	off_t first = 0, length = 0;
+	if (after && after + 1 < clusters + 2 && !clusterUsed(after + 1)) {
+		first = after + 1;
+		while (length < count && first + length < clusters + 2 && !clusterUsed(first + length)) length ++;
+	} else {
+		first = findFree(allocNext, count, length);
+	}
+	if (!first) {
+		ec = FileError::OUT_OF_SPACE;
+		return 0;
+	}
+	
+	// Chain the run and get it onto the media before linking it in,
+	// so an interruption can't leave a file pointing at free clusters, only leak the run.
+	for (off_t i = 0; i < length; i++) {
+		writeEntry(ec, first + i, i + 1 < length ? first + i + 1 : Clusters::END_OF_FILE);
+		if (ec) return 0;
+		markCluster(first + i, true);
+	}
+	usedClusters += length;
+	if (after) {
+		syncEntries(ec);
+		if (ec) return 0;
+		writeEntry(ec, after, first);
+		if (ec) return 0;
+	}
+	
+	// Next fit: the next search starts where this run ended.
+	allocNext   = first + length < clusters + 2 ? first + length : 2;
+	fsInfoDirty = true;
+	allocated   = length;
+	return first;
+}
+
+// Free the chain of clusters starting at `first`.
+bool FatFS::release(FileError &ec, off_t first) {
+	if (!writable) {
+		ec = FileError::READ_ONLY;
+		return false;
+	}
+	if (!countClusters(ec)) return false;
+	
+	// The chain ends at anything that isn't a used cluster, which also stops at loops.
+	off_t cur = first;
+	while (cur >= 2 && cur < clusters + 2 && clusterUsed(cur)) {
+		uint32_t next = fats[activeFat].read(ec, cur);
+		if (ec) return false;
+		writeEntry(ec, cur, Clusters::FREE);
+		if (ec) return false;
+		markCluster(cur, false);
+		usedClusters --;
+		cur = next;
+	}
+	
+	fsInfoDirty = true;
+	return true;
 }
 
 
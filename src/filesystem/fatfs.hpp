@@ -3,6 +3,7 @@
 
 #include "customio.hpp"
 #include "blockdevice.hpp"
+#include "readahead.hpp"
 #include <string.h>
 #include "unaligned_access.hpp"
 
@@ -165,6 +166,27 @@ struct __attribute__((packed)) BPB32 {
 static const std::size_t BPB32Offset = 36;
 static_assert(sizeof(BPBCommon) + sizeof(BPB16) == 512, "BPB must be 512 bytes total in size.");
 
+// FAT32 filesystem information sector, with hints for finding free clusters.
+struct __attribute__((packed)) FSInfo {
+	// Lead signature, 0x41615252.
+	uint32_t leadSig;
+	// Reserved, set to 0.
+	uint8_t _reserved0[480];
+	// Structure signature, 0x61417272.
+	uint32_t strucSig;
+	// Last known free cluster count, or 0xFFFFFFFF if unknown.
+	uint32_t freeCount;
+	// Cluster index to start looking for free clusters at, or 0xFFFFFFFF if unknown.
+	uint32_t nxtFree;
+	// Reserved, set to 0.
+	uint8_t _reserved1[12];
+	// Trail signature, 0xAA550000.
+	uint32_t trailSig;
+};
+static_assert(sizeof(FSInfo) == 512, "FSInfo must be 512 bytes in size.");
+// Value of FSInfo hints that are not known.
+static const uint32_t FSINFO_UNKNOWN = 0xFFFFFFFF;
+
 
 // Convert a name string to 8.3 format in an 11-char array.
 // Does not handle invalid names.
@@ -266,8 +288,29 @@ struct FatDirEnt: public DirEnt {
 
 
 // The FAT access helper class.
+// A cached FAT is held in RAM whole if it is small, or else through a window of a few of its sectors.
+// Large FATs on memory-mapped media are read in place instead.
 class FAT {
+	public:
+		// Largest FAT in bytes that is cached whole.
+		static const std::size_t FULL_CACHE_MAX = 8192;
+		// Number of sectors in the window of a larger FAT.
+		static const std::size_t WINDOW_SLOTS = 4;
+		
 	protected:
+		// Marks a window slot as not holding any sector.
+		static const off_t NONE = (off_t) -1;
+		
+		// Bookkeeping for one window slot.
+		struct Slot {
+			// FAT sector held in this slot, or NONE.
+			off_t sector;
+			// Value of `useCounter` when this slot was last used.
+			uint32_t lastUse;
+			// Whether the sector has writes not yet on the media.
+			bool dirty;
+		};
+		
 		// The block device to read from.
 		BlockDevice &bd;
 		// Block index of this FAT.
@@ -276,18 +319,44 @@ class FAT {
 		off_t size;
 		// Type of FAT to act as.
 		Type type;
-		// This FAT's cache, if any.
+		// This FAT's cache, if cached whole.
 		std::vector<uint8_t> cache;
 		// Whether the cache is both present and dirty.
 		bool dirty;
+		// Window slots, if cached through a window.
+		std::vector<Slot> slots;
+		// Sector data for all window slots.
+		std::vector<uint8_t> window;
+		// Incremented on every window access, used for LRU replacement.
+		uint32_t useCounter;
+		// Number of sectors holding entries.
+		off_t sectors;
+		
+		// Get the data for a window slot.
+		uint8_t *slotData(std::size_t slot) { return window.data() + slot * bd.blockSize(); }
+		// Find the window slot holding a FAT sector, or -1 if it isn't in the window.
+		int findSlot(off_t sector);
+		// Take the least recently used window slot other than `keep`, writing it back if dirty.
+		// Returns -1 on error.
+		int evict(FileError &ec, int keep);
+		// Get the window slot for a FAT sector, loading it if needed.
+		// On a miss, the sector after it is loaded into the window too, ready for walking a chain onwards.
+		// Returns -1 on error.
+		int loadSlot(FileError &ec, off_t sector);
+		// Write a window slot back to the media if dirty.
+		void writeBack(FileError &ec, std::size_t slot);
+		// Read bytes of this FAT, through the window if there is one.
+		void readBytes(FileError &ec, off_t offset, void *out, std::size_t len);
+		// Write bytes of this FAT, through the window if there is one.
+		void writeBytes(FileError &ec, off_t offset, const void *in, std::size_t len);
 		
 	public:
 		// Create a FAT.
 		FAT(BlockDevice &bd, off_t index, off_t size, Type type, bool cached);
 		
-		// Read an entry from the FAT.
+		// Read an entry from the FAT, without the reserved top 4 bits of FAT32 entries.
 		uint32_t read(FileError &ec, off_t index);
-		// Write an entry to the FAT.
+		// Write an entry to the FAT, keeping the reserved top 4 bits of FAT32 entries.
 		void write(FileError &ec, off_t index, uint32_t value);
 		// Save this to disk if cached.
 		void sync(FileError &ec);
@@ -296,7 +365,21 @@ class FAT {
 
 // The implementation of the file descriptor.
 class Stream: public FileDesc {
+	public:
+		// Most extents kept per stream; clusters past them are found by walking the FAT.
+		static const std::size_t MAX_EXTENTS = 128;
+		
 	protected:
+		// A run of physically consecutive clusters in the file.
+		struct Extent {
+			// Index in the file of the first cluster.
+			off_t index;
+			// Cluster index of the first cluster.
+			off_t cluster;
+			// Number of clusters.
+			off_t length;
+		};
+		
 		// The associated block device.
 		BlockDevice &bd;
 		// The associated filesystem.
@@ -305,14 +388,26 @@ class Stream: public FileDesc {
 		off_t baseCluster;
 		// The current cluster index.
 		off_t cluster;
+		// Index in the file of the current cluster.
+		off_t clusterIndex;
 		// The current byte position.
 		off_t pos;
 		// The current file size.
 		off_t size;
+		// Runs of clusters found so far, in file order, starting with the first cluster.
+		std::vector<Extent> extents;
+		// Sequential readahead for this stream.
+		Readahead ahead;
 		// TODO: Write capability.
 		
-		// Seek to the next cluster.
-		bool nextCluster(FileError &ec);
+		// Find the extent holding the cluster at `index` in the file, or -1 if it is past the known extents.
+		int findExtent(off_t index);
+		// Make the cluster at `index` in the file the current cluster.
+		// Known extents are binary searched; further clusters are looked up in the FAT and added to them.
+		bool seekCluster(FileError &ec, off_t index);
+		// Count the clusters from the current one up to the one at `lastIndex` that follow each other on disk.
+		// The last extent is extended from the FAT as needed; errors only cut the run short.
+		off_t runLength(off_t lastIndex);
 		
 	public:
 		// Constructs a stream.
@@ -347,6 +442,8 @@ class RootStream: public FileDesc {
 		off_t pos;
 		// The current file size.
 		off_t size;
+		// Sequential readahead for this stream.
+		Readahead ahead;
 		// TODO: Write capability.
 		
 	public:
@@ -403,10 +500,12 @@ class FatFS: public Filesystem {
 		// Total number of clusters in the data region.
 		off_t clusters;
 		
-		// Number of used clusters as per the FAT.
+		// Number of used clusters as per the FAT, once counted.
 		off_t usedClusters;
-		// How many non-defective clusters exist.
+		// How many non-defective clusters exist, once counted.
 		off_t validClusters;
+		// Whether the clusters have been counted.
+		bool clustersCounted;
 		// How big one cluster is.
 		off_t clusterSize;
 		
@@ -419,6 +518,21 @@ class FatFS: public Filesystem {
 		// Sector index of the first data sector.
 		off_t dataSectorIndex;
 		
+		// FAT32: Sector index of the FSInfo sector, 0 if there is none.
+		off_t fsInfoSector;
+		// Free cluster count from FSInfo, or FSINFO_UNKNOWN.
+		uint32_t fsInfoFree;
+		// Cluster index to look for free clusters from, from FSInfo, or FSINFO_UNKNOWN.
+		uint32_t fsInfoNext;
+		// Whether the free cluster hints changed since they were written to FSInfo.
+		bool fsInfoDirty;
+		
+		// Writable mounts: one bit per cluster from cluster 2 on, set if it is used or defective.
+		// It is built when the clusters are counted.
+		std::vector<uint32_t> clusterMap;
+		// Cluster index to start the next search for free clusters at.
+		off_t allocNext;
+		
 		// Handles for all FATs.
 		std::vector<FAT> fats;
 		// Index of the active FAT.
@@ -434,6 +548,26 @@ class FatFS: public Filesystem {
 		void interpretBPB16(std::vector<uint8_t> &cache, BPBCommon *common, BPB16 *bpb16);
 		// Interpret FAT32 BPB.
 		void interpretBPB32(std::vector<uint8_t> &cache, BPBCommon *common, BPB32 *bpb32);
+		// Read the free cluster hints from the FSInfo sector, if there is a valid one.
+		void readFSInfo();
+		// Write the free cluster hints to the FSInfo sector, if there is a valid one.
+		void writeFSInfo(FileError &ec);
+		
+		// Check whether a cluster is used or defective according to the cluster map.
+		bool clusterUsed(off_t cluster) const {
+			return clusterMap[(cluster - 2) / 32] >> ((cluster - 2) % 32) & 1;
+		}
+		// Mark a cluster as used or free in the cluster map.
+		void markCluster(off_t cluster, bool used);
+		// Find the first run of `count` free clusters, searching from cluster `from` on and wrapping around.
+		// If there is none, the longest shorter run is found instead.
+		// Returns the first cluster of the run and its length in `length`, or 0 if no cluster is free.
+		off_t findFree(off_t from, off_t count, off_t &length);
+		// Write an entry to all FATs that are kept in sync.
+		void writeEntry(FileError &ec, off_t index, uint32_t value);
+		// Save the FATs that entries are written to, then sync the media,
+		// so that nothing written afterwards reaches the media before them.
+		void syncEntries(FileError &ec);
 		
 		// Helper for getting a DirEnt from a file descriptor.
 		// Returns false when there are no more entries to read.
@@ -472,6 +606,25 @@ class FatFS: public Filesystem {
 		// Force any cached writes to be written to the media immediately.
 		// You should call this occasionally to prevent data loss and also every time before shutdown.
 		bool sync(FileError &ec);
+		
+		// Count the used and defective clusters by scanning the FAT.
+		// This is only done once, and not at mount, as it reads the whole FAT.
+		bool countClusters(FileError &ec);
+		// Get the number of free clusters.
+		// The FSInfo count is used if there is one, otherwise the clusters are counted.
+		off_t freeClusters(FileError &ec);
+		// Get the total number of clusters in the data region.
+		off_t clusterCount() const { return clusters; }
+		// Get how big one cluster is in bytes.
+		off_t bytesPerCluster() const { return clusterSize; }
+		
+		// Allocate up to `count` clusters as one chain, linked after cluster `after` if it isn't 0.
+		// The chain continues right after `after` if possible, so files stay in one piece;
+		// otherwise it goes in the first free run long enough, searching on from the previous allocation.
+		// Returns the first cluster and sets `allocated` to the number of clusters, or returns 0 on error.
+		off_t allocate(FileError &ec, off_t count, off_t after, off_t &allocated);
+		// Free the chain of clusters starting at `first`.
+		bool release(FileError &ec, off_t first);
 };
 
 } // namespace Fat
@@ -11,15 +11,17 @@
 #include "devfs.hpp"
 #include "compoundfs.hpp"
 #include "flash_bd.hpp"
-#include "rom_bd.hpp"
+#include "compressed_bd.hpp"
+#include "cached_bd.hpp"
+#include "bd_bench.hpp"
 #include "fatfs.hpp"
 #include "util.h"
 
 extern const unsigned char elf_file[];
 extern const unsigned int elf_file_length;
 
-extern const unsigned char fatty_iso[];
-extern const unsigned int fatty_iso_length;
+extern const unsigned char fatty_bdz[];
+extern const unsigned int fatty_bdz_length;
 
 #define SPI_MOSI    19
 #define SPI_MISO    16 // (unused)
@@ -108,14 +110,40 @@ void flash_test() {
 		temp[i]++;
 	}
 	dev.writeBlock(0, temp, dev.blockSize());
+	// Flush in small steps, as a main loop would, then sync as the barrier.
+	while (!dev.flushSome(1000)) tight_loop_contents();
 	dev.sync();
 	printf("Flash new value:\n");
 	hexdump(temp, 64);
 }
 
+// Run the block device benchmarks.
+// This destroys the contents of the flash test region.
+void bench_test() {
+	BenchConfig cfg{256, false, 1};
+	
+	// The embedded image is read-only.
+	CompressedBD rom(fatty_bdz, fatty_bdz_length, 512);
+	bdBench(rom, "CompressedBD", cfg);
+	
+	// The flash test region may be written.
+	cfg.writes = true;
+	{
+		FlashBD flash(512, 2032 * 1024, 16 * 1024);
+		bdBench(flash, "FlashBD", cfg);
+	}
+	{
+		CachedBD cached(std::make_unique<FlashBD>(512, 2032 * 1024, 16 * 1024), 4096);
+		bdBench(cached, "CachedBD 4 KiB (FlashBD)", cfg);
+	}
+}
+
 FILE *fat_test() {
 	// Make a read-only thing to mount from.
-	auto media = std::make_unique<RomBD>(fatty_iso, 512, fatty_iso_length);
+	auto media = std::make_unique<CompressedBD>(fatty_bdz, fatty_bdz_length, 512);
+	// Show its I/O statistics in /dev/blkstat.
+	auto dev = std::make_shared<DevFS>();
+	dev->addBlockDevice("fatty", media.get());
 	// Make the FAT filesystem.
 	auto fat = std::make_shared<FatFS>(FatFS(std::move(media), false));
 	sleep_ms(50);
@@ -131,8 +159,11 @@ FILE *fat_test() {
 			printf("%-12s: %u bytes\n", ent.name.c_str(), ent.size);
 	}
 	
-	// Set the filesystem impl to FAT.
-	setFS(fat);
+	// Mount FAT as root with the devices in /dev.
+	auto root = std::make_shared<CompoundFS>();
+	root->mount("/", fat);
+	root->mount("/dev", dev);
+	setFS(root);
 	// Return a handle through fopen.
 	FILE *fd = fopen("/lol/program.elf", "rb");
 	
@@ -161,6 +192,21 @@ FILE *fat_test() {
 	return fd;
 }
 
+// Print the block device statistics, to see how much of the time went to I/O.
+void blkstat_dump() {
+	FILE *fd = fopen("/dev/blkstat", "r");
+	if (!fd) {
+		printf("Error: %s\n", strerror(errno));
+		return;
+	}
+	char tmp[64];
+	size_t len;
+	while ((len = fread(tmp, 1, sizeof(tmp), fd)) > 0) {
+		fwrite(tmp, 1, len, stdout);
+	}
+	fclose(fd);
+}
+
 pax_buf_t *disp_pax_buffer;
 void *disp_framebuffer;
 
@@ -185,6 +231,10 @@ int main() {
 	printf("\n\n\n\n\n\n\n\n\n\n\n\nStartup time!\n\n");
 	sleep_ms(500);
 	
+#ifdef BD_BENCH
+	bench_test();
+#endif
+	
 	FILE *elf_fd = fat_test();
 	
 	size_t fb_len = 320 * 240;
@@ -224,6 +274,7 @@ int main() {
 		
 		if (loaded.valid) {
 			printf("ELF data loaded.\n");
+			blkstat_dump();
 			
 			// Obtain some information.
 			void **ptrtab = (void**) loaded.memory;